@@ -0,0 +1,204 @@
+/*
+ *
+ * ffbbench.c
+ *
+ * Measures the cost of the calls intercepted by libffbwrapper
+ *
+ * Copyright 2019 Bernat Arlandis <bernat@hotmail.com>
+ */
+
+/*
+ * This file is part of ffbtools.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <linux/input.h>
+
+/* Runs of each benchmark, the median is reported */
+#define FFBBENCH_RUNS (5)
+
+/*
+ * State shared by the iterations of a benchmark. The device is the one
+ * faked by libffbmock, the other file is never wrapped.
+ */
+struct ffbbench {
+    int device_fd;
+    int other_fd;
+    struct ff_effect effect;
+    struct input_event event;
+};
+
+typedef void (*ffbbench_function)(struct ffbbench *bench, long iteration);
+
+static uint64_t ffbbench_clock()
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+static void ffbbench_write_passthrough(struct ffbbench *bench, long iteration)
+{
+    (void) iteration;
+
+    if (write(bench->other_fd, &bench->event, sizeof(bench->event)) < 0) {
+        perror("write");
+        exit(1);
+    }
+}
+
+static void ffbbench_ioctl_passthrough(struct ffbbench *bench, long iteration)
+{
+    int version;
+
+    (void) iteration;
+
+    ioctl(bench->other_fd, EVIOCGVERSION, &version);
+}
+
+/*
+ * Updates the same effect with a changing level, like games do every frame.
+ */
+static void ffbbench_upload(struct ffbbench *bench, long iteration)
+{
+    bench->effect.u.constant.level = iteration & 0x3fff;
+    if (ioctl(bench->device_fd, EVIOCSFF, &bench->effect) < 0) {
+        perror("EVIOCSFF");
+        exit(1);
+    }
+}
+
+static void ffbbench_play(struct ffbbench *bench, long iteration)
+{
+    bench->event.type = EV_FF;
+    bench->event.code = bench->effect.id;
+    bench->event.value = iteration & 1;
+    if (write(bench->device_fd, &bench->event, sizeof(bench->event)) < 0) {
+        perror("write");
+        exit(1);
+    }
+}
+
+static const struct {
+    const char *name;
+    ffbbench_function function;
+} benchmarks[] = {
+    {"write-passthrough", ffbbench_write_passthrough},
+    {"ioctl-passthrough", ffbbench_ioctl_passthrough},
+    {"upload", ffbbench_upload},
+    {"play", ffbbench_play},
+};
+
+static int ffbbench_compare(const void *a, const void *b)
+{
+    double x = *(const double*) a;
+    double y = *(const double*) b;
+
+    return x < y ? -1 : x > y;
+}
+
+int main(int argc, char *argv[])
+{
+    struct ffbbench bench;
+    ffbbench_function function = NULL;
+    const char *device_name = "/dev/null";
+    const char *config = "default";
+    double results[FFBBENCH_RUNS];
+    long iterations = 1000000;
+    uint64_t start;
+    int c;
+
+    while ((c = getopt(argc, argv, "d:n:c:")) != -1) {
+        switch (c) {
+            case 'd':
+                device_name = optarg;
+                break;
+            case 'n':
+                iterations = atol(optarg);
+                break;
+            case 'c':
+                config = optarg;
+                break;
+            default:
+                return 1;
+        }
+    }
+
+    for (size_t i = 0; optind < argc && i < sizeof(benchmarks) / sizeof(benchmarks[0]); i++) {
+        if (!strcmp(benchmarks[i].name, argv[optind])) {
+            function = benchmarks[i].function;
+        }
+    }
+
+    if (function == NULL || iterations < 1) {
+        printf("Usage: %s [-d device] [-n iterations] [-c config] <benchmark>\n", argv[0]);
+        printf("Benchmarks:");
+        for (size_t i = 0; i < sizeof(benchmarks) / sizeof(benchmarks[0]); i++) {
+            printf(" %s", benchmarks[i].name);
+        }
+        printf("\n");
+        exit(1);
+    }
+
+    memset(&bench, 0, sizeof(bench));
+    bench.device_fd = open(device_name, O_RDWR);
+    bench.other_fd = open("/dev/zero", O_RDWR);
+    if (bench.device_fd < 0 || bench.other_fd < 0) {
+        fprintf(stderr, "ERROR: can not open %s (%s)\n", device_name, strerror(errno));
+        exit(1);
+    }
+
+    bench.effect.type = FF_CONSTANT;
+    bench.effect.id = -1;
+    bench.effect.direction = 0x4000;
+    if (ioctl(bench.device_fd, EVIOCSFF, &bench.effect) < 0) {
+        fprintf(stderr, "ERROR: can not upload an effect to %s (%s), is libffbmock preloaded?\n",
+                device_name, strerror(errno));
+        exit(1);
+    }
+
+    // The first run warms up caches and lets the wrapper threads start
+    for (int run = 0; run <= FFBBENCH_RUNS; run++) {
+        start = ffbbench_clock();
+        for (long i = 0; i < iterations; i++) {
+            function(&bench, i);
+        }
+        if (run > 0) {
+            results[run - 1] = (double)(ffbbench_clock() - start) / iterations;
+        }
+    }
+
+    qsort(results, FFBBENCH_RUNS, sizeof(results[0]), ffbbench_compare);
+
+    printf("{\"benchmark\": \"%s\", \"config\": \"%s\", \"iterations\": %ld, \"runs\": %d, "
+            "\"ns_per_op\": %.1f, \"min_ns_per_op\": %.1f}\n", argv[optind], config, iterations,
+            FFBBENCH_RUNS, results[FFBBENCH_RUNS / 2], results[0]);
+
+    close(bench.device_fd);
+    close(bench.other_fd);
+
+    return 0;
+}
@@ -0,0 +1,111 @@
+/*
+ *
+ * ffbconv.c
+ *
+ * Converts FFB logs between the text and binary formats
+ *
+ * Copyright 2019 Bernat Arlandis <bernat@hotmail.com>
+ */
+
+/*
+ * This file is part of ffbtools.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "ffbtrace.h"
+
+int main(int argc, char *argv[])
+{
+    struct ffbt_trace input;
+    struct ffbt_trace output;
+    struct ffbt_record record;
+    FILE *input_file;
+    FILE *output_file;
+    int format = -1;
+    int result;
+    int c;
+
+    while ((c = getopt(argc, argv, "bt")) != -1) {
+        switch (c) {
+            case 'b':
+                format = FFBT_TRACE_BINARY;
+                break;
+            case 't':
+                format = FFBT_TRACE_TEXT;
+                break;
+            default:
+                return 1;
+        }
+    }
+
+    if (optind + 2 != argc) {
+        printf("Usage: %s [-b|-t] <input file> <output file>\n", argv[0]);
+        printf("Converts to binary (-b) or text (-t), by default to the other format.\n");
+        exit(1);
+    }
+
+    input_file = fopen(argv[optind], "r");
+    if (input_file == NULL) {
+        fprintf(stderr, "ERROR: can not open %s (%s)\n", argv[optind], strerror(errno));
+        exit(1);
+    }
+
+    if (ffbt_trace_open_read(&input, input_file) < 0) {
+        fprintf(stderr, "ERROR: %s is not a valid trace\n", argv[optind]);
+        exit(1);
+    }
+
+    if (format == -1) {
+        format = input.format == FFBT_TRACE_TEXT ? FFBT_TRACE_BINARY : FFBT_TRACE_TEXT;
+    }
+
+    if (!strcmp(argv[optind + 1], "-")) {
+        output_file = stdout;
+    } else {
+        output_file = fopen(argv[optind + 1], "w");
+    }
+    if (output_file == NULL) {
+        fprintf(stderr, "ERROR: can not open %s (%s)\n", argv[optind + 1], strerror(errno));
+        exit(1);
+    }
+
+    ffbt_trace_open_write(&output, output_file, format, 0, NULL);
+
+    while ((result = ffbt_trace_read(&input, &record)) > 0) {
+        if (ffbt_trace_write(&output, &record, input.comment) < 0) {
+            fprintf(stderr, "ERROR: can not write %s (%s)\n", argv[optind + 1], strerror(errno));
+            exit(1);
+        }
+    }
+
+    if (result < 0) {
+        fprintf(stderr, "ERROR: %s is corrupted\n", argv[optind]);
+        exit(1);
+    }
+
+    fclose(input_file);
+    if (fclose(output_file) != 0) {
+        fprintf(stderr, "ERROR: can not write %s (%s)\n", argv[optind + 1], strerror(errno));
+        exit(1);
+    }
+
+    return 0;
+}
@@ -0,0 +1,383 @@
+/*
+ *
+ * ffbmerge.c
+ *
+ * Merges the FFB logs written by several processes in time order
+ *
+ * Copyright 2019 Bernat Arlandis <bernat@hotmail.com>
+ */
+
+/*
+ * This file is part of ffbtools.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <ctype.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "ffbtrace.h"
+
+/* Records read ahead at the start of a log looking for its time origin */
+#define FFBMERGE_HEADER_RECORDS (4)
+
+struct ffbt_pending {
+    struct ffbt_record record;
+    char comment[1024];
+};
+
+/*
+ * The log of a process. Recordings made with --log-mmap are split in
+ * several segments that are read one after the other. Only the next record
+ * of each log is kept in memory.
+ */
+struct ffbt_input {
+    char **files;
+    int file_count;
+    int next_file;
+    FILE *file;
+    struct ffbt_trace trace;
+    struct ffbt_pending pending[FFBMERGE_HEADER_RECORDS];
+    int pending_count;
+    int pending_next;
+    struct ffbt_record record;
+    const char *comment;
+    uint64_t time;
+    int pid;
+    int index;
+};
+
+/*
+ * Segments are named <log>.<pid>.<n>, the ones with the same name but the
+ * number are from the same process.
+ */
+static size_t ffbt_stream_length(const char *name)
+{
+    size_t length = strlen(name);
+    size_t digits = 0;
+
+    while (digits < length && isdigit((unsigned char) name[length - digits - 1])) {
+        digits++;
+    }
+
+    if (digits != 4 || digits == length || name[length - digits - 1] != '.') {
+        return length;
+    }
+
+    return length - digits - 1;
+}
+
+static bool ffbt_same_stream(const char *a, const char *b)
+{
+    size_t length = ffbt_stream_length(a);
+
+    return length != strlen(a) && length == ffbt_stream_length(b) && !strncmp(a, b, length);
+}
+
+static void ffbt_open_next_file(struct ffbt_input *input)
+{
+    const char *name = input->files[input->next_file];
+    uint64_t epoch = input->trace.epoch;
+    bool first = input->next_file == 0;
+
+    if (input->file != NULL) {
+        fclose(input->file);
+    }
+
+    input->file = fopen(name, "r");
+    if (input->file == NULL) {
+        fprintf(stderr, "ERROR: can not open %s (%s)\n", name, strerror(errno));
+        exit(1);
+    }
+
+    if (ffbt_trace_open_read(&input->trace, input->file) < 0) {
+        fprintf(stderr, "ERROR: %s is not a valid trace\n", name);
+        exit(1);
+    }
+
+    // The settings were already read from the first segment
+    if (!first) {
+        input->trace.info_pending = 0;
+        if (input->trace.epoch == 0) {
+            input->trace.epoch = epoch;
+        }
+    }
+
+    input->next_file++;
+}
+
+static int ffbt_read_record(struct ffbt_input *input)
+{
+    int result;
+
+    for (;;) {
+        result = ffbt_trace_read(&input->trace, &input->record);
+        if (result < 0) {
+            fprintf(stderr, "ERROR: %s is corrupted\n", input->files[input->next_file - 1]);
+            exit(1);
+        }
+        if (result > 0) {
+            break;
+        }
+        if (input->next_file == input->file_count) {
+            fclose(input->file);
+            input->file = NULL;
+            return 0;
+        }
+        ffbt_open_next_file(input);
+    }
+
+    return 1;
+}
+
+/*
+ * Logs start with a comment telling the process and, in text logs, the time
+ * origin. The records before it are kept until it's read.
+ */
+static void ffbt_read_header(struct ffbt_input *input)
+{
+    struct ffbt_pending *pending;
+    const char *pid;
+
+    while ((input->trace.epoch == 0 || input->pid == 0) && input->pending_count < FFBMERGE_HEADER_RECORDS) {
+        if (!ffbt_read_record(input)) {
+            break;
+        }
+        pending = &input->pending[input->pending_count++];
+        pending->record = input->record;
+        snprintf(pending->comment, sizeof(pending->comment), "%s", input->trace.comment);
+        if (input->record.time != 0) {
+            break;
+        }
+        if (input->record.op == FFBT_OP_NOTE && input->record.tag == FFBT_TAG_COMMENT &&
+                (pid = strstr(pending->comment, FFBT_TRACE_PID)) != NULL) {
+            input->pid = atoi(pid + strlen(FFBT_TRACE_PID));
+        }
+    }
+}
+
+/*
+ * Reads the next record of a log and works out its absolute time. Returns 0
+ * at the end of the log.
+ */
+static int ffbt_read_input(struct ffbt_input *input)
+{
+    if (input->pending_next < input->pending_count) {
+        input->record = input->pending[input->pending_next].record;
+        input->comment = input->pending[input->pending_next].comment;
+        input->pending_next++;
+    } else if (input->file != NULL && ffbt_read_record(input)) {
+        input->comment = input->trace.comment;
+    } else {
+        return 0;
+    }
+
+    input->time = input->trace.epoch + input->record.time;
+
+    return 1;
+}
+
+/*
+ * Min-heap of the logs ordered by the time of their next record. Records
+ * with the same time keep the order of the logs in the command line.
+ */
+static bool ffbt_before(const struct ffbt_input *a, const struct ffbt_input *b)
+{
+    return a->time < b->time || (a->time == b->time && a->index < b->index);
+}
+
+static void ffbt_heap_down(struct ffbt_input **heap, int count, int i)
+{
+    struct ffbt_input *input = heap[i];
+    int child;
+
+    while ((child = 2 * i + 1) < count) {
+        if (child + 1 < count && ffbt_before(heap[child + 1], heap[child])) {
+            child++;
+        }
+        if (!ffbt_before(heap[child], input)) {
+            break;
+        }
+        heap[i] = heap[child];
+        i = child;
+    }
+
+    heap[i] = input;
+}
+
+/*
+ * Tells where the following records come from, the process id or the log
+ * name when it's not known.
+ */
+static void ffbt_write_mark(struct ffbt_trace *output, const struct ffbt_input *input)
+{
+    char comment[1024];
+    struct ffbt_record record = {
+        .time = input->time,
+        .op = FFBT_OP_NOTE,
+        .tag = FFBT_TAG_COMMENT,
+    };
+
+    if (input->pid != 0) {
+        snprintf(comment, sizeof(comment), FFBT_TRACE_PID "%d", input->pid);
+    } else {
+        snprintf(comment, sizeof(comment), "%s", input->files[0]);
+    }
+    ffbt_trace_write(output, &record, comment);
+}
+
+static void usage(const char *name)
+{
+    printf("Usage: %s [-b|-t] [-p] [-o <output file>] <log> [<log>...]\n", name);
+    printf("Merges the logs of several processes in time order, to text (-t, default) or binary (-b).\n");
+    printf("Marks the records of each process with -p.\n");
+    exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+    struct ffbt_input *inputs;
+    struct ffbt_input **heap;
+    struct ffbt_input *input;
+    struct ffbt_input *last = NULL;
+    struct ffbt_trace output;
+    struct ffbt_record record;
+    const char *output_name = "-";
+    FILE *output_file;
+    char comment[64];
+    int format = FFBT_TRACE_TEXT;
+    bool marks = false;
+    uint64_t epoch = UINT64_MAX;
+    int input_count = 0;
+    int count = 0;
+    int c;
+
+    while ((c = getopt(argc, argv, "btpo:")) != -1) {
+        switch (c) {
+            case 'b':
+                format = FFBT_TRACE_BINARY;
+                break;
+            case 't':
+                format = FFBT_TRACE_TEXT;
+                break;
+            case 'p':
+                marks = true;
+                break;
+            case 'o':
+                output_name = optarg;
+                break;
+            default:
+                usage(argv[0]);
+        }
+    }
+
+    if (optind == argc) {
+        usage(argv[0]);
+    }
+
+    inputs = calloc(argc - optind, sizeof(*inputs));
+    heap = calloc(argc - optind, sizeof(*heap));
+    if (inputs == NULL || heap == NULL) {
+        fprintf(stderr, "ERROR: out of memory\n");
+        exit(1);
+    }
+
+    for (int i = optind; i < argc; i++) {
+        if (input_count > 0 && ffbt_same_stream(argv[i - 1], argv[i])) {
+            inputs[input_count - 1].file_count++;
+            continue;
+        }
+        inputs[input_count].files = &argv[i];
+        inputs[input_count].file_count = 1;
+        inputs[input_count].index = input_count;
+        input_count++;
+    }
+
+    for (int i = 0; i < input_count; i++) {
+        ffbt_open_next_file(&inputs[i]);
+        ffbt_read_header(&inputs[i]);
+        if (ffbt_read_input(&inputs[i])) {
+            heap[count++] = &inputs[i];
+        }
+    }
+
+    // The first records tell the time origin of the logs
+    for (int i = 0; i < count; i++) {
+        if (heap[i]->trace.epoch < epoch) {
+            epoch = heap[i]->trace.epoch;
+        }
+    }
+    if (epoch == UINT64_MAX) {
+        epoch = 0;
+    }
+
+    for (int i = count / 2 - 1; i >= 0; i--) {
+        ffbt_heap_down(heap, count, i);
+    }
+
+    if (!strcmp(output_name, "-")) {
+        output_file = stdout;
+    } else {
+        output_file = fopen(output_name, "w");
+    }
+    if (output_file == NULL) {
+        fprintf(stderr, "ERROR: can not open %s (%s)\n", output_name, strerror(errno));
+        exit(1);
+    }
+
+    ffbt_trace_open_write(&output, output_file, format, epoch, NULL);
+
+    memset(&record, 0, sizeof(record));
+    record.time = epoch;
+    record.op = FFBT_OP_NOTE;
+    record.tag = FFBT_TAG_COMMENT;
+    snprintf(comment, sizeof(comment), FFBT_TRACE_EPOCH "%llu", (unsigned long long) epoch);
+    ffbt_trace_write(&output, &record, comment);
+
+    while (count > 0) {
+        input = heap[0];
+
+        if (marks && input != last) {
+            ffbt_write_mark(&output, input);
+            last = input;
+        }
+
+        input->record.time = input->time;
+        if (ffbt_trace_write(&output, &input->record, input->comment) < 0) {
+            fprintf(stderr, "ERROR: can not write %s (%s)\n", output_name, strerror(errno));
+            exit(1);
+        }
+
+        if (!ffbt_read_input(input)) {
+            heap[0] = heap[--count];
+        }
+        ffbt_heap_down(heap, count, 0);
+    }
+
+    if (fclose(output_file) != 0) {
+        fprintf(stderr, "ERROR: can not write %s (%s)\n", output_name, strerror(errno));
+        exit(1);
+    }
+
+    free(heap);
+    free(inputs);
+
+    return 0;
+}
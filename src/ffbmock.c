@@ -0,0 +1,472 @@
+/*
+ *
+ * ffbmock.c
+ *
+ * Fake force feedback device for testing and benchmarking without hardware
+ *
+ * Copyright 2019 Bernat Arlandis <bernat@hotmail.com>
+ */
+
+/*
+ * This file is part of ffbtools.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#define _GNU_SOURCE
+#include <dlfcn.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#define ioctl ioctl_trash_function
+#include <linux/input.h>
+#undef ioctl
+
+#include "ffbtrace.h"
+
+#define FFBMOCK_DEFAULT_DEVICE "/dev/null"
+#define FFBMOCK_DEFAULT_SLOTS (16)
+#define FFBMOCK_MAX_SLOTS (1024)
+#define FFBMOCK_MAX_FDS (65536)
+
+#define ioctlRequestCode(request) (request & ((_IOC_DIRMASK << _IOC_DIRSHIFT) | (_IOC_TYPEMASK << _IOC_TYPESHIFT) | (_IOC_NRMASK << _IOC_NRSHIFT)))
+
+static void ffbmock_init() __attribute__((constructor));
+static void ffbmock_close() __attribute__((destructor));
+
+static int (*_ioctl)(int fd, unsigned long request, char *argp) = NULL;
+static ssize_t (*_write)(int fd, const void *buf, size_t num) = NULL;
+static int (*_open)(const char *pathname, int flags, ...) = NULL;
+static int (*_open64)(const char *pathname, int flags, ...) = NULL;
+static int (*_openat)(int dirfd, const char *pathname, int flags, ...) = NULL;
+static int (*_openat64)(int dirfd, const char *pathname, int flags, ...) = NULL;
+static int (*_close)(int fd) = NULL;
+
+static dev_t mock_device = 0;
+static int mock_slots = FFBMOCK_DEFAULT_SLOTS;
+static uint64_t mock_latency = 0;
+static int mock_position = 0;
+static _Atomic uint8_t mock_fds[FFBMOCK_MAX_FDS];
+
+/*
+ * The device state, one for all the fds like a single evdev device would
+ * have. Effects don't belong to the fd that uploaded them.
+ */
+static pthread_mutex_t mock_lock = PTHREAD_MUTEX_INITIALIZER;
+static bool mock_used[FFBMOCK_MAX_SLOTS];
+static bool mock_playing[FFBMOCK_MAX_SLOTS];
+static unsigned long mock_counts[FFBT_OP_AUTOCENTER + 1];
+static unsigned long mock_errors = 0;
+static FILE *mock_log_file = NULL;
+static struct ffbt_trace mock_trace;
+
+static uint64_t ffbmock_now()
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * (uint64_t)1000000000 + now.tv_nsec;
+}
+
+static void ffbmock_resolve_symbols()
+{
+    _ioctl = dlsym(RTLD_NEXT, "ioctl");
+    _write = dlsym(RTLD_NEXT, "write");
+    _open = dlsym(RTLD_NEXT, "open");
+    _open64 = dlsym(RTLD_NEXT, "open64");
+    _openat = dlsym(RTLD_NEXT, "openat");
+    _openat64 = dlsym(RTLD_NEXT, "openat64");
+    _close = dlsym(RTLD_NEXT, "close");
+}
+
+/*
+ * Takes the processing time of the device. It's a busy wait, sleeping
+ * can't be that accurate.
+ */
+static void ffbmock_process()
+{
+    uint64_t end;
+
+    if (mock_latency == 0) {
+        return;
+    }
+
+    end = ffbmock_now() + mock_latency;
+    while (ffbmock_now() < end);
+}
+
+/*
+ * Records a command and its reply in the log, if there's one.
+ */
+static void ffbmock_record(struct ffbt_record *record, int result)
+{
+    mock_counts[record->op]++;
+    if (result < 0) {
+        mock_errors++;
+    }
+
+    if (mock_log_file == NULL) {
+        return;
+    }
+
+    record->time = ffbmock_now();
+    ffbt_trace_write(&mock_trace, record, NULL);
+
+    record->flags = FFBT_REC_REPLY;
+    record->result = result;
+    ffbt_trace_write(&mock_trace, record, NULL);
+}
+
+static bool ffbmock_is_device(int fd)
+{
+    return fd >= 0 && fd < FFBMOCK_MAX_FDS && atomic_load_explicit(&mock_fds[fd], memory_order_relaxed);
+}
+
+static void ffbmock_track_fd(int fd)
+{
+    struct stat info;
+
+    if (fd < 0 || fd >= FFBMOCK_MAX_FDS) {
+        return;
+    }
+
+    atomic_store(&mock_fds[fd], fstat(fd, &info) == 0 && S_ISCHR(info.st_mode) && info.st_rdev == mock_device);
+}
+
+static int ffbmock_upload(struct ff_effect *effect)
+{
+    if (effect->id == -1) {
+        for (int id = 0; id < mock_slots; id++) {
+            if (!mock_used[id]) {
+                mock_used[id] = true;
+                effect->id = id;
+                return 0;
+            }
+        }
+        return -ENOSPC;
+    }
+
+    if (effect->id < 0 || effect->id >= mock_slots || !mock_used[effect->id]) {
+        return -EINVAL;
+    }
+
+    return 0;
+}
+
+static int ffbmock_ioctl(int fd, unsigned long request, char *argp)
+{
+    struct ffbt_record record;
+    struct ff_effect *effect;
+    int result = 0;
+    int id;
+
+    // The wheel stays where it's told, for the condition renderer
+    if (ioctlRequestCode(request) == ioctlRequestCode(EVIOCGABS(ABS_X))) {
+        memset(argp, 0, sizeof(struct input_absinfo));
+        ((struct input_absinfo*) argp)->value = mock_position;
+        ((struct input_absinfo*) argp)->minimum = -32768;
+        ((struct input_absinfo*) argp)->maximum = 32767;
+        return 0;
+    }
+
+    memset(&record, 0, sizeof(record));
+    record.fd = fd;
+
+    pthread_mutex_lock(&mock_lock);
+    ffbmock_process();
+
+    switch (ioctlRequestCode(request)) {
+        case ioctlRequestCode(EVIOCGBIT(EV_FF, 0)):
+            memset(argp, 0, _IOC_SIZE(request));
+            for (int bit = FF_EFFECT_MIN; bit <= FF_WAVEFORM_MAX; bit++) {
+                if (bit / 8 < (int)_IOC_SIZE(request) && bit != FF_CUSTOM) {
+                    argp[bit / 8] |= 1 << (bit % 8);
+                }
+            }
+            for (int bit = FF_GAIN; bit <= FF_AUTOCENTER; bit++) {
+                if (bit / 8 < (int)_IOC_SIZE(request)) {
+                    argp[bit / 8] |= 1 << (bit % 8);
+                }
+            }
+            record.op = FFBT_OP_QUERY;
+            break;
+        case ioctlRequestCode(EVIOCGEFFECTS):
+            *((int*)argp) = mock_slots;
+            record.op = FFBT_OP_SLOTS;
+            record.value = mock_slots;
+            break;
+        case ioctlRequestCode(EVIOCRMFF):
+            id = (int)((intptr_t)argp);
+            if (id < 0 || id >= mock_slots || !mock_used[id]) {
+                result = -EINVAL;
+            } else {
+                mock_used[id] = false;
+                mock_playing[id] = false;
+            }
+            record.op = FFBT_OP_REMOVE;
+            record.value = id;
+            break;
+        case ioctlRequestCode(EVIOCSFF):
+            effect = (struct ff_effect*) argp;
+            record.op = FFBT_OP_UPLOAD;
+            record.effect = ffbt_effect_pack(effect);
+            result = ffbmock_upload(effect);
+            record.value = effect->id;
+            break;
+        default:
+            pthread_mutex_unlock(&mock_lock);
+            return _ioctl(fd, request, argp);
+    }
+
+    ffbmock_record(&record, result);
+    pthread_mutex_unlock(&mock_lock);
+
+    if (result < 0) {
+        errno = -result;
+        return -1;
+    }
+
+    return result;
+}
+
+static ssize_t ffbmock_write(int fd, const struct input_event *event, size_t num)
+{
+    struct ffbt_record record;
+    int result = 0;
+
+    memset(&record, 0, sizeof(record));
+    record.fd = fd;
+    record.value = event->value;
+
+    pthread_mutex_lock(&mock_lock);
+    ffbmock_process();
+
+    switch (event->code) {
+        case FF_GAIN:
+            record.op = FFBT_OP_GAIN;
+            break;
+        case FF_AUTOCENTER:
+            record.op = FFBT_OP_AUTOCENTER;
+            break;
+        default:
+            record.op = FFBT_OP_PLAY;
+            record.aux = event->code;
+            if (event->code >= mock_slots || !mock_used[event->code]) {
+                result = -EINVAL;
+            } else {
+                mock_playing[event->code] = event->value > 0;
+            }
+            break;
+    }
+
+    ffbmock_record(&record, result < 0 ? result : (int)num);
+    pthread_mutex_unlock(&mock_lock);
+
+    if (result < 0) {
+        errno = -result;
+        return -1;
+    }
+
+    return num;
+}
+
+static void ffbmock_init()
+{
+    const char *str_device = getenv("FFBMOCK_DEVICE");
+    const char *str_slots = getenv("FFBMOCK_SLOTS");
+    const char *str_latency = getenv("FFBMOCK_LATENCY");
+    const char *str_position = getenv("FFBMOCK_POSITION");
+    const char *str_log = getenv("FFBMOCK_LOG");
+    struct stat info;
+
+    ffbmock_resolve_symbols();
+
+    if (str_device == NULL) {
+        str_device = FFBMOCK_DEFAULT_DEVICE;
+    }
+    if (stat(str_device, &info) < 0 || !S_ISCHR(info.st_mode)) {
+        fprintf(stderr, "ffbmock: %s is not a character device\n", str_device);
+        return;
+    }
+    mock_device = info.st_rdev;
+
+    if (str_slots != NULL && atoi(str_slots) > 0) {
+        mock_slots = atoi(str_slots);
+        if (mock_slots > FFBMOCK_MAX_SLOTS) {
+            mock_slots = FFBMOCK_MAX_SLOTS;
+        }
+    }
+
+    if (str_latency != NULL) {
+        mock_latency = strtoull(str_latency, NULL, 10) * 1000;
+    }
+
+    if (str_position != NULL) {
+        mock_position = atoi(str_position);
+    }
+
+    if (str_log != NULL) {
+        mock_log_file = fopen(str_log, "w");
+        if (mock_log_file == NULL) {
+            fprintf(stderr, "ffbmock: can not open %s (%s)\n", str_log, strerror(errno));
+        } else {
+            ffbt_trace_open_write(&mock_trace, mock_log_file, FFBT_TRACE_TEXT, ffbmock_now(), "ffbmock");
+        }
+    }
+
+    // Descriptors opened before the library was loaded
+    for (int fd = 0; fd < 1024; fd++) {
+        ffbmock_track_fd(fd);
+    }
+}
+
+static void ffbmock_close()
+{
+    if (mock_device == 0) {
+        return;
+    }
+
+    fprintf(stderr, "ffbmock: %lu uploads, %lu removes, %lu plays, %lu gains, %lu autocenters, %lu errors\n",
+            mock_counts[FFBT_OP_UPLOAD], mock_counts[FFBT_OP_REMOVE], mock_counts[FFBT_OP_PLAY],
+            mock_counts[FFBT_OP_GAIN], mock_counts[FFBT_OP_AUTOCENTER], mock_errors);
+
+    if (mock_log_file != NULL) {
+        fclose(mock_log_file);
+    }
+}
+
+int ioctl(int fd, unsigned long request, char *argp)
+{
+    if (_ioctl == NULL) {
+        ffbmock_resolve_symbols();
+    }
+
+    if (!ffbmock_is_device(fd)) {
+        return _ioctl(fd, request, argp);
+    }
+
+    return ffbmock_ioctl(fd, request, argp);
+}
+
+ssize_t write(int fd, const void *buf, size_t num)
+{
+    if (_write == NULL) {
+        ffbmock_resolve_symbols();
+    }
+
+    if (!ffbmock_is_device(fd) || num < sizeof(struct input_event) ||
+            ((const struct input_event*) buf)->type != EV_FF) {
+        return _write(fd, buf, num);
+    }
+
+    return ffbmock_write(fd, buf, num);
+}
+
+#define ffbmock_open_mode(flags, mode) \
+    do { \
+        if (__OPEN_NEEDS_MODE(flags)) { \
+            va_list args; \
+            va_start(args, flags); \
+            mode = va_arg(args, mode_t); \
+            va_end(args); \
+        } \
+    } while (0)
+
+int open(const char *pathname, int flags, ...)
+{
+    mode_t mode = 0;
+    int fd;
+
+    ffbmock_open_mode(flags, mode);
+    if (_open == NULL) {
+        ffbmock_resolve_symbols();
+    }
+
+    fd = _open(pathname, flags, mode);
+    ffbmock_track_fd(fd);
+
+    return fd;
+}
+
+int open64(const char *pathname, int flags, ...)
+{
+    mode_t mode = 0;
+    int fd;
+
+    ffbmock_open_mode(flags, mode);
+    if (_open64 == NULL) {
+        ffbmock_resolve_symbols();
+    }
+
+    fd = _open64(pathname, flags, mode);
+    ffbmock_track_fd(fd);
+
+    return fd;
+}
+
+int openat(int dirfd, const char *pathname, int flags, ...)
+{
+    mode_t mode = 0;
+    int fd;
+
+    ffbmock_open_mode(flags, mode);
+    if (_openat == NULL) {
+        ffbmock_resolve_symbols();
+    }
+
+    fd = _openat(dirfd, pathname, flags, mode);
+    ffbmock_track_fd(fd);
+
+    return fd;
+}
+
+int openat64(int dirfd, const char *pathname, int flags, ...)
+{
+    mode_t mode = 0;
+    int fd;
+
+    ffbmock_open_mode(flags, mode);
+    if (_openat64 == NULL) {
+        ffbmock_resolve_symbols();
+    }
+
+    fd = _openat64(dirfd, pathname, flags, mode);
+    ffbmock_track_fd(fd);
+
+    return fd;
+}
+
+int close(int fd)
+{
+    if (_close == NULL) {
+        ffbmock_resolve_symbols();
+    }
+
+    if (fd >= 0 && fd < FFBMOCK_MAX_FDS) {
+        atomic_store(&mock_fds[fd], 0);
+    }
+
+    return _close(fd);
+}
@@ -37,11 +37,73 @@
 #include <time.h>
 #include <unistd.h>
 #include <ctype.h>
+#include <getopt.h>
+#include <sched.h>
+#include <sys/mman.h>
+
+#include "ffbtrace.h"
 
 #define print_option(option, text, ...) printf("  %c. " text "\n", option, ##__VA_ARGS__)
 
+/* Lateness histogram buckets, powers of two in us */
+#define FFBT_LATENESS_BUCKETS (18)
+
 int device_handle;
 
+/*
+ * Log line ready to be replayed. Commands that aren't sent only print
+ * their note. Effect ids are the ones in the log.
+ */
+struct ffbt_command {
+    uint64_t time;
+    int op;
+    int id;
+    int value;
+    int save_id;
+    struct ff_effect effect;
+    char *note;
+    char *trace;
+};
+
+enum ffbt_call {
+    FFBT_CALL_UPLOAD = 0,
+    FFBT_CALL_PLAY,
+    FFBT_CALL_STOP,
+    FFBT_CALL_REMOVE,
+    FFBT_CALL_GAIN,
+    FFBT_CALL_AUTOCENTER,
+    FFBT_CALLS,
+};
+
+/*
+ * Time taken by every device call made in a replay, in ns.
+ */
+struct ffbt_stats {
+    uint32_t *times;
+    uint32_t *latencies;
+    uint8_t *calls;
+    int count;
+    unsigned long errors[FFBT_CALLS];
+};
+
+struct ffbt_playlist {
+    struct ffbt_command *commands;
+    int count;
+    int capacity;
+    int *ids;
+    int id_count;
+};
+
+/*
+ * How late commands were sent compared to the time in the log.
+ */
+struct ffbt_lateness {
+    unsigned long buckets[FFBT_LATENESS_BUCKETS];
+    unsigned long count;
+    uint64_t total;
+    uint64_t max;
+};
+
 int ffbt_set_gain(int gain)
 {
     struct input_event event;
@@ -119,58 +181,6 @@ int ffbt_remove_effect(int id)
     return 1;
 }
 
-void ffbt_init_effect(struct ff_effect *effect)
-{
-    effect->id = -1;
-    effect->trigger.button = 0;
-    effect->trigger.interval = 0;
-    effect->replay.length = 0;
-    effect->replay.delay = 0;
-    effect->direction = 0x4000;
-    switch (effect->type) {
-        case FF_CONSTANT:
-            effect->u.constant.level = 0x6000;
-            effect->u.constant.envelope.attack_length = 0;
-            effect->u.constant.envelope.attack_level = 0;
-            effect->u.constant.envelope.fade_length = 0;
-            effect->u.constant.envelope.fade_level = 0;
-            break;
-        case FF_RAMP:
-            effect->u.ramp.start_level = 0x0000;
-            effect->u.ramp.end_level = 0x6000;
-            effect->u.ramp.envelope.attack_length = 0;
-            effect->u.ramp.envelope.attack_level = 0;
-            effect->u.ramp.envelope.fade_length = 0;
-            effect->u.ramp.envelope.fade_level = 0;
-            break;
-        case FF_PERIODIC:
-            effect->u.periodic.period = 1000;
-            effect->u.periodic.magnitude = 0x6000;
-            effect->u.periodic.offset = 0;
-            effect->u.periodic.phase = 0;
-            effect->u.periodic.envelope.attack_length = 0;
-            effect->u.periodic.envelope.attack_level = 0;
-            effect->u.periodic.envelope.fade_length = 0;
-            effect->u.periodic.envelope.fade_level = 0;
-            break;
-        case FF_SPRING:
-        case FF_DAMPER:
-        case FF_FRICTION:
-        case FF_INERTIA:
-            effect->u.condition[0].left_saturation = 0xffff;
-            effect->u.condition[0].right_saturation = 0xffff;
-            effect->u.condition[0].left_coeff = 0x4000;
-            effect->u.condition[0].right_coeff = 0x4000;
-            effect->u.condition[0].deadband = 0;
-            effect->u.condition[0].center = 0;
-            break;
-        case FF_RUMBLE:
-            effect->u.rumble.strong_magnitude = 0x6000;
-            effect->u.rumble.weak_magnitude = 0x2000;
-            break;
-    }
-}
-
 void ffbt_simple_effect(struct ff_effect *effect)
 {
     ffbt_init_effect(effect);
@@ -488,6 +498,37 @@ void menu_set_autocenter()
     ffbt_set_autocenter(level);
 }
 
+static struct ffbt_command *ffbt_add_command(struct ffbt_playlist *playlist)
+{
+    if (playlist->count == playlist->capacity) {
+        playlist->capacity = playlist->capacity > 0 ? playlist->capacity * 2 : 1024;
+        playlist->commands = realloc(playlist->commands, playlist->capacity * sizeof(*playlist->commands));
+        if (playlist->commands == NULL) {
+            fprintf(stderr, "Error: out of memory.\n");
+            exit(1);
+        }
+    }
+
+    memset(&playlist->commands[playlist->count], 0, sizeof(*playlist->commands));
+    return &playlist->commands[playlist->count++];
+}
+
+/*
+ * Makes room in the id table for a log id. Negative ids aren't valid.
+ */
+static bool ffbt_reserve_id(struct ffbt_playlist *playlist, int id)
+{
+    if (id < 0) {
+        return false;
+    }
+
+    if (id >= playlist->id_count) {
+        playlist->id_count = id + 1;
+    }
+
+    return true;
+}
+
 void ffbt_main_menu()
 {
     char option;
@@ -525,245 +566,397 @@ void ffbt_main_menu()
     } while (option != 'q');
 }
 
-void ffbt_new_effect(struct ff_effect *effect, char *params)
+static uint64_t ffbt_clock()
 {
-    char *next_param;
-    char *param;
-    char *key;
-    char *value;
-    int nvalue;
-
-
-    value = strstr(params, "type:") + 5;
-    if (strstr(value, "CONSTANT") == value) {
-        effect->type = FF_CONSTANT;
-    } else if (strstr(value, "RAMP") == value) {
-        effect->type = FF_RAMP;
-    } else if (strstr(value, "SPRING") == value) {
-        effect->type = FF_SPRING;
-    } else if (strstr(value, "DAMPER") == value) {
-        effect->type = FF_DAMPER;
-    } else if (strstr(value, "FRICTION") == value) {
-        effect->type = FF_FRICTION;
-    } else if (strstr(value, "INERTIA") == value) {
-        effect->type = FF_INERTIA;
-    } else if (strstr(value, "PERIODIC") == value) {
-        effect->type = FF_PERIODIC;
-    } else if (strstr(value, "RUMBLE") == value) {
-        effect->type = FF_RUMBLE;
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * (uint64_t)1000000000 + now.tv_nsec;
+}
+
+/*
+ * Waits until an absolute time in ns. It sleeps until the spin time before
+ * it and busy waits the rest, since waking up from sleep can take longer
+ * than the accuracy needed.
+ */
+static void ffbt_wait_until(uint64_t deadline, uint64_t spin_time)
+{
+    struct timespec wake_time;
+
+    if (deadline > spin_time) {
+        wake_time.tv_sec = (deadline - spin_time) / 1000000000;
+        wake_time.tv_nsec = (deadline - spin_time) % 1000000000;
+        while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &wake_time, NULL) == EINTR);
     }
 
-    ffbt_init_effect(effect);
+    while (ffbt_clock() < deadline);
+}
 
-    for(; (param = strtok_r(params, " ", &next_param)); params = NULL) {
-        key = strtok_r(param, ":", &value);
-        if (effect->type == FF_PERIODIC && !strcmp(key, "waveform")) {
-            if (!strcmp(value, "SINE")) {
-                effect->u.periodic.waveform = FF_SINE;
-            } else if (!strcmp(value, "SQUARE")) {
-                effect->u.periodic.waveform = FF_SQUARE;
-            } else if (!strcmp(value, "TRIANGLE")) {
-                effect->u.periodic.waveform = FF_TRIANGLE;
-            } else if (!strcmp(value, "SAW_UP")) {
-                effect->u.periodic.waveform = FF_SAW_UP;
-            } else if (!strcmp(value, "SAW_DOWN")) {
-                effect->u.periodic.waveform = FF_SAW_DOWN;
-            }
+static void ffbt_lateness_add(struct ffbt_lateness *lateness, uint64_t late)
+{
+    int bucket = 0;
+
+    for (uint64_t us = late / 1000; us > 0 && bucket < FFBT_LATENESS_BUCKETS - 1; us >>= 1) {
+        bucket++;
+    }
+
+    lateness->buckets[bucket]++;
+    lateness->count++;
+    lateness->total += late;
+    if (late > lateness->max) {
+        lateness->max = late;
+    }
+}
+
+static void ffbt_lateness_print(const struct ffbt_lateness *lateness)
+{
+    unsigned long peak = 0;
+    int last = 0;
+
+    if (lateness->count == 0) {
+        return;
+    }
+
+    for (int i = 0; i < FFBT_LATENESS_BUCKETS; i++) {
+        if (lateness->buckets[i] > 0) {
+            last = i;
+        }
+        if (lateness->buckets[i] > peak) {
+            peak = lateness->buckets[i];
+        }
+    }
+
+    printf("\nCommand lateness (%lu commands, average %.1f us, max %.1f us):\n",
+            lateness->count, lateness->total / 1e3 / lateness->count, lateness->max / 1e3);
+    for (int i = 0; i <= last; i++) {
+        int width = 50 * lateness->buckets[i] / peak;
+
+        if (i == FFBT_LATENESS_BUCKETS - 1) {
+            printf("  >= %6lu us", 1ul << (i - 1));
         } else {
-            nvalue = strtol(value, NULL, 0);
-            if (!strcmp(key, "id")) {
-                effect->id = nvalue;
-            } else if (!strcmp(key, "length")) {
-                effect->replay.length = nvalue;
-            } else if (!strcmp(key, "delay")) {
-                effect->replay.delay = nvalue;
-            } else if (!strcmp(key, "dir")) {
-                effect->direction = nvalue;
-            } else {
-                switch (effect->type) {
-                    case FF_CONSTANT:
-                        if (!strcmp(key, "level")) {
-                            effect->u.constant.level = nvalue;
-                        }
-                        break;
-                    case FF_RAMP:
-                        if (!strcmp(key, "start_level")) {
-                            effect->u.ramp.start_level = nvalue;
-                        } else if (!strcmp(key, "end_level")) {
-                            effect->u.ramp.end_level = nvalue;
-                        }
-                        break;
-                    case FF_SPRING:
-                        if (!strcmp(key, "deadband")) {
-                            effect->u.condition[0].deadband = nvalue;
-                        } else if (!strcmp(key, "center")) {
-                            effect->u.condition[0].center = nvalue;
-                        }
-                        // fall through
-                    case FF_DAMPER:
-                    case FF_FRICTION:
-                    case FF_INERTIA:
-                        if (!strcmp(key, "left_saturation")) {
-                            effect->u.condition[0].left_saturation = nvalue;
-                        } else if (!strcmp(key, "right_saturation")) {
-                            effect->u.condition[0].right_saturation = nvalue;
-                        } else if (!strcmp(key, "left_coeff")) {
-                            effect->u.condition[0].left_coeff = nvalue;
-                        } else if (!strcmp(key, "right_coeff")) {
-                            effect->u.condition[0].right_coeff = nvalue;
-                        }
-                        break;
-                    case FF_RUMBLE:
-                        if (!strcmp(key, "strong_rumble")) {
-                            effect->u.rumble.strong_magnitude = nvalue;
-                        } else if (!strcmp(key, "weak_rumble")) {
-                            effect->u.rumble.weak_magnitude = nvalue;
-                        }
-                        break;
-                    case FF_PERIODIC:
-                        if (!strcmp(key, "period")) {
-                            effect->u.periodic.period = nvalue;
-                        } else if (!strcmp(key, "magnitude")) {
-                            effect->u.periodic.magnitude = nvalue;
-                        } else if (!strcmp(key, "offset")) {
-                            effect->u.periodic.offset = nvalue;
-                        } else if (!strcmp(key, "phase")) {
-                            effect->u.periodic.phase = nvalue;
-                        }
-                        break;
-                }
-            }
+            printf("  <  %6lu us", 1ul << i);
         }
+        printf(" %8lu %.*s\n", lateness->buckets[i], width,
+                "##################################################");
     }
 }
 
-void ffbt_play_file(const char *file_name, int trace_mode)
+/*
+ * Loads a log into a list of commands ready to be sent, so playback only
+ * has to wait and send them. New effects get the id the device gives them
+ * when they're uploaded, the log ids are mapped to them through the id
+ * table, which is sized here for the largest log id.
+ */
+void ffbt_load_file(struct ffbt_playlist *playlist, const char *file_name, int trace_mode)
 {
     FILE *file = fopen(file_name, "r");
-    struct timespec now;
-    struct timespec start_time;
-    struct ff_effect effect;
+    struct ffbt_trace trace;
+    struct ffbt_record record;
+    struct ffbt_command *command;
     char line[1024];
-    char *token;
-    char *next_token;
-    char *prefix;
-    char *op;
-    unsigned long time, delta_time;
-    int first = 1;
-    int id;
-    int count;
-    int ids[255] = {-1};
-    int save_id = -1;
-    int new_id;
-    int return_code;
+    int pending = -1;
+    int result;
 
     if (file == NULL) {
         printf("Error: %s", strerror(errno));
         exit(1);
     }
 
-    printf("Playing %s\n\n", file_name);
+    if (ffbt_trace_open_read(&trace, file) < 0) {
+        fprintf(stderr, "Error: %s is not a valid trace.\n", file_name);
+        exit(1);
+    }
+
+    memset(playlist, 0, sizeof(*playlist));
 
-    while (fgets(line, sizeof(line), file)) {
-        if (trace_mode) {
-            printf("%s\n", line);
-        }
-        token = strtok(line, "\n");
-        if (token == NULL || token[0] == '\0') {
-            continue;
+    while ((result = ffbt_trace_read(&trace, &record)) > 0) {
+        bool shown = record.op == FFBT_OP_NOTE || (record.flags & FFBT_REC_COMMENTED);
+        bool sent = !shown && !(record.flags & FFBT_REC_REPLY);
+
+        if (record.flags & FFBT_REC_REPLY && !shown) {
+            // The device gives the id to the new effect
+            if (pending >= 0 && record.op == FFBT_OP_UPLOAD && record.result == 0 &&
+                    ffbt_reserve_id(playlist, record.value)) {
+                playlist->commands[pending].save_id = record.value;
+            }
+            pending = -1;
         }
-        token = strtok_r(token, " ", &next_token);
-        if (token == NULL || token[0] == '\0') {
+
+        if (!sent && !shown && !trace_mode) {
             continue;
         }
-        time = strtol(token, NULL, 10);
-        if (first) {
-            first = 0;
-            clock_gettime(CLOCK_MONOTONIC, &start_time);
-            start_time.tv_sec -= time / 1000000;
-            start_time.tv_nsec -= (time % 1000000) * 1000;
-        } else {
-            clock_gettime(CLOCK_MONOTONIC, &now);
-            delta_time = (now.tv_sec - start_time.tv_sec) * 1000000 +
-                (now.tv_nsec - start_time.tv_nsec) / 1000;
-            if (time > delta_time) {
-                usleep(time - delta_time);
+
+        command = ffbt_add_command(playlist);
+        command->time = record.time;
+        command->op = sent ? record.op : FFBT_OP_NOTE;
+        command->save_id = -1;
+
+        if (trace_mode || shown) {
+            ffbt_format_record(line, sizeof(line), &record, trace.comment);
+            if (trace_mode) {
+                command->trace = strdup(line);
+            }
+            if (shown) {
+                command->note = trace_mode ? command->trace : strdup(line);
             }
         }
-        if (next_token[0] == '#') {
-            printf("%s\n", next_token);
+
+        if (!sent) {
             continue;
-        } else {
-            prefix = strtok_r(NULL, " ", &next_token);
-            if (prefix[0] == '<') {
-                if (save_id == -1) {
-                    continue;
+        }
+
+        // Commands for negative ids are kept as notes, they aren't sent
+        pending = -1;
+        switch (record.op) {
+            case FFBT_OP_GAIN:
+            case FFBT_OP_AUTOCENTER:
+                command->value = record.value;
+                break;
+            case FFBT_OP_UPLOAD:
+                ffbt_effect_unpack(&command->effect, &record.effect);
+                command->id = command->effect.id;
+                if (command->id == -1) {
+                    pending = playlist->count - 1;
+                } else if (!ffbt_reserve_id(playlist, command->id)) {
+                    command->op = FFBT_OP_NOTE;
                 }
-                return_code = strtol(strtok_r(NULL, " ", &next_token), NULL, 10);
-                if (return_code != 0) {
-                    save_id = -1;
-                    continue;
+                break;
+            case FFBT_OP_PLAY:
+                command->id = record.aux;
+                command->value = record.value;
+                if (!ffbt_reserve_id(playlist, command->id)) {
+                    command->op = FFBT_OP_NOTE;
                 }
-                token = strtok_r(NULL, ":", &next_token);
-                new_id = strtol(next_token, NULL, 10);
-                ids[new_id] = save_id;
-                save_id = -1;
-                continue;
-            }
-            save_id = -1;
-            op = strtok_r(NULL, " ", &next_token);
-            if (!strcmp(op, "QUERY") || !strcmp(op, "SLOTS")) {
-                continue;
-            }
+                break;
+            case FFBT_OP_REMOVE:
+                command->id = record.value;
+                if (!ffbt_reserve_id(playlist, command->id)) {
+                    command->op = FFBT_OP_NOTE;
+                }
+                break;
         }
-        if (!strcmp(op, "GAIN")) {
-            ffbt_set_gain(strtol(next_token, NULL, 0));
-        } else if (!strcmp(op, "AUTOCENTER")) {
-            ffbt_set_autocenter(strtol(next_token, NULL, 0));
-        } else if (!strcmp(op, "UPLOAD")) {
-            ffbt_new_effect(&effect, next_token);
-            if (effect.id == -1) {
-                ffbt_upload_effect(&effect);
-                save_id = effect.id;
-            } else if (ids[effect.id] != -1) {
-                effect.id = ids[effect.id];
-                ffbt_upload_effect(&effect);
+    }
+
+    if (result < 0) {
+        fprintf(stderr, "Error: %s is corrupted.\n", file_name);
+        exit(1);
+    }
+
+    fclose(file);
+
+    playlist->ids = malloc(playlist->id_count * sizeof(*playlist->ids));
+    if (playlist->id_count > 0 && playlist->ids == NULL) {
+        fprintf(stderr, "Error: out of memory.\n");
+        exit(1);
+    }
+    for (int i = 0; i < playlist->id_count; i++) {
+        playlist->ids[i] = -1;
+    }
+}
+
+static int ffbt_compare_latencies(const void *a, const void *b)
+{
+    uint32_t x = *(const uint32_t*) a;
+    uint32_t y = *(const uint32_t*) b;
+
+    return x < y ? -1 : x > y;
+}
+
+/*
+ * Prints the rate commands were sent at, and the percentiles of the time
+ * the device calls took for each kind of command.
+ */
+static void ffbt_stats_print(struct ffbt_stats *stats, uint64_t elapsed)
+{
+    static const char *names[] = {
+        [FFBT_CALL_UPLOAD] = "upload",
+        [FFBT_CALL_PLAY] = "play",
+        [FFBT_CALL_STOP] = "stop",
+        [FFBT_CALL_REMOVE] = "remove",
+        [FFBT_CALL_GAIN] = "gain",
+        [FFBT_CALL_AUTOCENTER] = "autocenter",
+    };
+    uint32_t *latencies = stats->latencies;
+    unsigned long errors = 0;
+    int count;
+
+    for (int call = 0; call < FFBT_CALLS; call++) {
+        errors += stats->errors[call];
+    }
+
+    printf("\nSent %d commands in %.3f s, %.0f commands/s, %lu errors\n", stats->count, elapsed / 1e9,
+            elapsed > 0 ? stats->count * 1e9 / elapsed : 0, errors);
+    if (stats->count == 0) {
+        return;
+    }
+
+    printf("  %-10s %8s %8s %8s %8s %8s %8s\n", "call", "count", "errors", "p50 us", "p99 us", "p99.9 us", "max us");
+    for (int call = 0; call < FFBT_CALLS; call++) {
+        count = 0;
+        for (int i = 0; i < stats->count; i++) {
+            if (stats->calls[i] == call) {
+                latencies[count++] = stats->times[i];
             }
-        } else if (!strcmp(op, "PLAY")) {
-            id = strtol(strtok_r(NULL, " ", &next_token), NULL, 0);
-            count = strtol(strtok_r(NULL, " ", &next_token), NULL, 0);
-            if (ids[id] != -1) {
-                ffbt_play_effect(ids[id], count);
+        }
+        if (count == 0) {
+            continue;
+        }
+
+        qsort(latencies, count, sizeof(*latencies), ffbt_compare_latencies);
+        printf("  %-10s %8d %8lu %8.1f %8.1f %8.1f %8.1f\n", names[call], count, stats->errors[call],
+                latencies[count / 2] / 1e3, latencies[(int)(count * 0.99)] / 1e3,
+                latencies[(int)(count * 0.999)] / 1e3, latencies[count - 1] / 1e3);
+    }
+}
+
+/*
+ * Sends the commands at their time in the log, counting from the first
+ * one. Times are divided by the speed, or they're sent one after another
+ * when the speed is 0.
+ */
+void ffbt_play(struct ffbt_playlist *playlist, uint64_t spin_time, double speed)
+{
+    struct ffbt_lateness lateness;
+    struct ffbt_stats stats;
+    struct ffbt_command *command;
+    struct ff_effect effect;
+    uint64_t start_time = 0;
+    uint64_t deadline = 0;
+    uint64_t call_time;
+    int *ids = playlist->ids;
+    int call = 0;
+    int success = 1;
+
+    memset(&lateness, 0, sizeof(lateness));
+    memset(&stats, 0, sizeof(stats));
+    stats.times = malloc(playlist->count * sizeof(*stats.times));
+    stats.latencies = malloc(playlist->count * sizeof(*stats.latencies));
+    stats.calls = malloc(playlist->count * sizeof(*stats.calls));
+    if (playlist->count > 0 && (stats.times == NULL || stats.latencies == NULL || stats.calls == NULL)) {
+        fprintf(stderr, "Error: out of memory.\n");
+        exit(1);
+    }
+
+    start_time = ffbt_clock();
+    for (int i = 0; i < playlist->count; i++) {
+        command = &playlist->commands[i];
+
+        if (speed > 0) {
+            deadline = start_time + (command->time - playlist->commands[0].time) / speed;
+            ffbt_wait_until(deadline, spin_time);
+        }
+
+        if (command->trace != NULL) {
+            printf("%012lu %s\n", (unsigned long)(command->time / 1000), command->trace);
+        }
+        if (command->op == FFBT_OP_NOTE) {
+            if (command->note != NULL) {
+                printf("%s\n", command->note);
             }
-        } else if (!strcmp(op, "STOP")) {
-            id = strtol(strtok_r(NULL, " ", &next_token), NULL, 0);
-            if (ids[id] != -1) {
-                ffbt_play_effect(ids[id], 0);
+            continue;
+        }
+
+        call_time = ffbt_clock();
+        if (speed > 0) {
+            ffbt_lateness_add(&lateness, call_time - deadline);
+        }
+
+        call = -1;
+        switch (command->op) {
+            case FFBT_OP_GAIN:
+                call = FFBT_CALL_GAIN;
+                success = ffbt_set_gain(command->value);
+                break;
+            case FFBT_OP_AUTOCENTER:
+                call = FFBT_CALL_AUTOCENTER;
+                success = ffbt_set_autocenter(command->value);
+                break;
+            case FFBT_OP_UPLOAD:
+                if (command->id == -1) {
+                    call = FFBT_CALL_UPLOAD;
+                    effect = command->effect;
+                    success = ffbt_upload_effect(&effect);
+                    if (success && command->save_id >= 0) {
+                        ids[command->save_id] = effect.id;
+                    }
+                } else if (ids[command->id] != -1) {
+                    call = FFBT_CALL_UPLOAD;
+                    effect = command->effect;
+                    effect.id = ids[command->id];
+                    success = ffbt_upload_effect(&effect);
+                }
+                break;
+            case FFBT_OP_PLAY:
+                if (ids[command->id] != -1) {
+                    call = command->value > 0 ? FFBT_CALL_PLAY : FFBT_CALL_STOP;
+                    success = ffbt_play_effect(ids[command->id], command->value);
+                }
+                break;
+            case FFBT_OP_REMOVE:
+                if (ids[command->id] != -1) {
+                    call = FFBT_CALL_REMOVE;
+                    success = ffbt_remove_effect(ids[command->id]);
+                    ids[command->id] = -1;
+                }
+                break;
+        }
+
+        if (call >= 0) {
+            stats.times[stats.count] = ffbt_clock() - call_time;
+            stats.calls[stats.count++] = call;
+            if (!success) {
+                stats.errors[call]++;
             }
-        } else if (!strcmp(op, "REMOVE")) {
-            id = strtol(strtok_r(NULL, " ", &next_token), NULL, 0);
-            ffbt_remove_effect(id);
-            ids[id] = -1;
         }
     }
+
+    ffbt_stats_print(&stats, ffbt_clock() - start_time);
+    if (speed > 0) {
+        ffbt_lateness_print(&lateness);
+    }
+
+    free(stats.times);
+    free(stats.latencies);
+    free(stats.calls);
+}
+
+void ffbt_free_playlist(struct ffbt_playlist *playlist)
+{
+    for (int i = 0; i < playlist->count; i++) {
+        if (playlist->commands[i].note != playlist->commands[i].trace) {
+            free(playlist->commands[i].note);
+        }
+        free(playlist->commands[i].trace);
+    }
+    free(playlist->commands);
+    free(playlist->ids);
 }
 
 int main(int argc, char * argv[])
 {
-    const char *device_name;
+    const char *device_name = NULL;
     const char *file_name;
     int interactive_mode = 0;
     int trace_mode = 0;
+    int priority = 0;
+    int lock_memory = 0;
+    uint64_t spin_time = 0;
+    double speed = 1;
     int c;
+    static const struct option long_options[] = {
+        {"speed", required_argument, NULL, 'x'},
+        {"as-fast-as-possible", no_argument, NULL, 'a'},
+        {NULL, 0, NULL, 0}
+    };
 
     if (argc == 1) {
-        printf("Syntax: %s -d <device> [-i] [-t] [file]\n", argv[0]);
+        printf("Syntax: %s -d <device> [-i] [-t] [-p priority] [-m] [-s spin us] [-x|--speed factor] [-a|--as-fast-as-possible] [file]\n", argv[0]);
         exit(1);
     }
 
     opterr = 0;
 
-    while ((c = getopt(argc, argv, "d:it")) != -1) {
+    while ((c = getopt_long(argc, argv, "d:itp:ms:x:a", long_options, NULL)) != -1) {
         switch (c)
         {
             case 'd':
@@ -775,8 +968,27 @@ int main(int argc, char * argv[])
             case 't':
                 trace_mode = 1;
                 break;
+            case 'p':
+                priority = atoi(optarg);
+                break;
+            case 'm':
+                lock_memory = 1;
+                break;
+            case 's':
+                spin_time = strtoull(optarg, NULL, 10) * 1000;
+                break;
+            case 'x':
+                speed = atof(optarg);
+                if (speed <= 0) {
+                    fprintf(stderr, "Invalid speed %s.\n", optarg);
+                    return 1;
+                }
+                break;
+            case 'a':
+                speed = 0;
+                break;
             case '?':
-                if (optopt == 'd')
+                if (optopt == 'd' || optopt == 'p' || optopt == 's' || optopt == 'x')
                     fprintf(stderr, "Option -%c requires an argument.\n", optopt);
                 else if (isprint (optopt))
                     fprintf(stderr, "Unknown option `-%c'.\n", optopt);
@@ -818,10 +1030,29 @@ int main(int argc, char * argv[])
 
     ffbt_set_gain(0xffff);
 
+    if (lock_memory && mlockall(MCL_CURRENT | MCL_FUTURE) < 0) {
+        fprintf(stderr, "WARNING: can not lock memory (%s)\n", strerror(errno));
+    }
+
+    if (priority > 0) {
+        struct sched_param param = {
+            .sched_priority = priority
+        };
+
+        if (sched_setscheduler(0, SCHED_FIFO, &param) < 0) {
+            fprintf(stderr, "WARNING: can not set realtime priority (%s)\n", strerror(errno));
+        }
+    }
+
     if (interactive_mode) {
         ffbt_main_menu();
     } else {
-        ffbt_play_file(file_name, trace_mode);
+        struct ffbt_playlist playlist;
+
+        ffbt_load_file(&playlist, file_name, trace_mode);
+        printf("Playing %s\n\n", file_name);
+        ffbt_play(&playlist, spin_time, speed);
+        ffbt_free_playlist(&playlist);
     }
 
     close(device_handle);
@@ -0,0 +1,789 @@
+/*
+ *
+ * ffbrender.c
+ *
+ * Renders the force commanded by a FFB log over time
+ *
+ * Copyright 2019 Bernat Arlandis <bernat@hotmail.com>
+ */
+
+/*
+ * This file is part of ffbtools.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <errno.h>
+#include <math.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "ffbtrace.h"
+
+/* Samples rendered at once */
+#define FFBT_RENDER_BLOCK (4096)
+/* Four floats fit the vector registers of any x86_64 or ARM64 CPU */
+#define FFBT_RENDER_LANES (4)
+#define FFBT_RENDER_DEFAULT_RATE (1000)
+#define FFBT_RENDER_MAX_FORCE (0x7fff)
+
+typedef float ffbt_vf __attribute__((vector_size(FFBT_RENDER_LANES * sizeof(float))));
+typedef int32_t ffbt_vi __attribute__((vector_size(FFBT_RENDER_LANES * sizeof(int32_t))));
+
+/*
+ * Log command that changes the force, with the effect ids already resolved
+ * to the effects rendered.
+ */
+struct ffbt_render_event {
+    uint64_t time;
+    int op;
+    int effect;
+    int value;
+    struct ff_effect data;
+};
+
+/*
+ * An effect as the device plays it. Times are in ms since the start of the
+ * render.
+ */
+struct ffbt_render_effect {
+    struct ff_effect data;
+    bool playing;
+    int count;
+    double start;
+    float peak;
+    double clipped_sum;
+};
+
+/*
+ * The effects removed leave their slot to the next ones uploaded, so there
+ * are only as many as play at once.
+ */
+struct ffbt_render {
+    struct ffbt_render_event *events;
+    int event_count;
+    int event_capacity;
+    struct ffbt_render_effect *effects;
+    int effect_count;
+    int *free_effects;
+    int free_count;
+    bool direction_fix;
+    bool offset_fix;
+    int skipped;
+};
+
+/*
+ * Parameters of an effect for a run of samples where it's playing, taken
+ * from the first sample. Time is in ms since the start of the current
+ * repetition and phase in periods.
+ */
+struct ffbt_render_kernel {
+    int type;
+    int waveform;
+    float time;
+    float step;
+    float phase;
+    float phase_step;
+    float length;
+    float level;
+    float end_level;
+    float offset;
+    float attack_length;
+    float attack_level;
+    float fade_length;
+    float fade_level;
+    float scale;
+};
+
+static ffbt_vf ffbt_vf_set(float value)
+{
+    ffbt_vf vector;
+
+    for (int i = 0; i < FFBT_RENDER_LANES; i++) {
+        vector[i] = value;
+    }
+
+    return vector;
+}
+
+/*
+ * Takes lanes from a where the mask is set, from b elsewhere. Comparisons
+ * give the masks.
+ */
+static ffbt_vf ffbt_vf_select(ffbt_vi mask, ffbt_vf a, ffbt_vf b)
+{
+    return (ffbt_vf)(((ffbt_vi) a & mask) | ((ffbt_vi) b & ~mask));
+}
+
+static ffbt_vf ffbt_vf_abs(ffbt_vf x)
+{
+    return ffbt_vf_select(x < 0, -x, x);
+}
+
+/*
+ * Fraction part of non negative values.
+ */
+static ffbt_vf ffbt_vf_fract(ffbt_vf x)
+{
+    return x - __builtin_convertvector(__builtin_convertvector(x, ffbt_vi), ffbt_vf);
+}
+
+/*
+ * Sine of a phase in periods. A parabola refined once, the error is about
+ * 0.1% of the magnitude.
+ */
+static ffbt_vf ffbt_vf_sine(ffbt_vf phase)
+{
+    ffbt_vf x = ffbt_vf_fract(phase + 0.5f) - 0.5f;
+    ffbt_vf y = 8.0f * x - 16.0f * x * ffbt_vf_abs(x);
+
+    return 0.225f * (y * ffbt_vf_abs(y) - y) + y;
+}
+
+static ffbt_vf ffbt_vf_waveform(int waveform, ffbt_vf phase)
+{
+    switch (waveform) {
+        case FF_SQUARE:
+            return ffbt_vf_select(ffbt_vf_fract(phase) < 0.5f, ffbt_vf_set(1), ffbt_vf_set(-1));
+        case FF_TRIANGLE:
+            return 1.0f - 4.0f * ffbt_vf_abs(ffbt_vf_fract(phase + 0.25f) - 0.5f);
+        case FF_SINE:
+            return ffbt_vf_sine(phase);
+        case FF_SAW_UP:
+            return 2.0f * ffbt_vf_fract(phase + 0.5f) - 1.0f;
+        case FF_SAW_DOWN:
+            return 1.0f - 2.0f * ffbt_vf_fract(phase + 0.5f);
+    }
+
+    return ffbt_vf_set(0);
+}
+
+/*
+ * Applies the envelope to a level, keeping its sign. The attack goes from
+ * the attack level to the effect level and the fade from the effect level to
+ * the fade level.
+ */
+static ffbt_vf ffbt_vf_envelope(const struct ffbt_render_kernel *kernel, ffbt_vf level, ffbt_vf time)
+{
+    ffbt_vf magnitude = ffbt_vf_abs(level);
+    ffbt_vf sign = ffbt_vf_select(level < 0, ffbt_vf_set(-1), ffbt_vf_set(1));
+    ffbt_vf attack;
+    ffbt_vf fade;
+
+    if (kernel->attack_length > 0) {
+        attack = kernel->attack_level + (magnitude - kernel->attack_level) * time / kernel->attack_length;
+        magnitude = ffbt_vf_select(time < kernel->attack_length, attack, magnitude);
+    }
+
+    if (kernel->fade_length > 0 && kernel->length > 0) {
+        fade = kernel->fade_level + (magnitude - kernel->fade_level) * (kernel->length - time) / kernel->fade_length;
+        magnitude = ffbt_vf_select(time > kernel->length - kernel->fade_length, fade, magnitude);
+    }
+
+    return sign * magnitude;
+}
+
+/*
+ * Adds the force of an effect to a run of samples. The buffers are read and
+ * written a vector at a time, the last partial one only up to the run.
+ */
+static void ffbt_render_kernel(const struct ffbt_render_kernel *kernel, int count, float *total, float *contribution)
+{
+    ffbt_vf lanes;
+    ffbt_vf offset;
+    ffbt_vf time;
+    ffbt_vf phase;
+    ffbt_vf level;
+    ffbt_vf sum;
+
+    for (int i = 0; i < FFBT_RENDER_LANES; i++) {
+        lanes[i] = i;
+    }
+
+    for (int i = 0; i < count; i += FFBT_RENDER_LANES) {
+        offset = lanes + (float) i;
+        time = kernel->time + offset * kernel->step;
+
+        switch (kernel->type) {
+            case FF_CONSTANT:
+                level = ffbt_vf_set(kernel->level);
+                break;
+            case FF_RAMP:
+                // Ramps with no length play until stopped at the start level
+                if (kernel->length > 0) {
+                    level = kernel->level + (kernel->end_level - kernel->level) * time / kernel->length;
+                } else {
+                    level = ffbt_vf_set(kernel->level);
+                }
+                break;
+            case FF_PERIODIC:
+                phase = kernel->phase + offset * kernel->phase_step;
+                level = kernel->level * ffbt_vf_waveform(kernel->waveform, phase);
+                break;
+            default:
+                level = ffbt_vf_set(0);
+                break;
+        }
+
+        level = ffbt_vf_envelope(kernel, level, time);
+        if (kernel->type == FF_PERIODIC) {
+            level += kernel->offset;
+        }
+        level *= kernel->scale;
+
+        size_t size = (count - i < FFBT_RENDER_LANES ? count - i : FFBT_RENDER_LANES) * sizeof(float);
+
+        memcpy(&sum, total + i, size);
+        sum += level;
+        memcpy(total + i, &sum, size);
+        if (contribution != NULL) {
+            memcpy(contribution + i, &level, size);
+        }
+    }
+}
+
+static const struct ff_envelope *ffbt_render_envelope(const struct ff_effect *effect)
+{
+    switch (effect->type) {
+        case FF_CONSTANT:
+            return &effect->u.constant.envelope;
+        case FF_RAMP:
+            return &effect->u.ramp.envelope;
+        case FF_PERIODIC:
+            return &effect->u.periodic.envelope;
+    }
+
+    return NULL;
+}
+
+/*
+ * Renders an effect from the given time for a number of samples, splitting
+ * them in runs of the same repetition. Only the first axis is rendered, the
+ * direction projects the force on it.
+ */
+static void ffbt_render_effect(const struct ffbt_render_effect *effect, double time, double step,
+        int count, float gain, float *total, float *contribution)
+{
+    const struct ff_effect *data = &effect->data;
+    const struct ff_envelope *envelope = ffbt_render_envelope(data);
+    struct ffbt_render_kernel kernel;
+    double delay = data->replay.delay;
+    double length = data->replay.length;
+    double elapsed;
+    double position;
+    int repetition;
+    int first;
+    int last;
+
+    if (envelope == NULL) {
+        return;
+    }
+
+    memset(&kernel, 0, sizeof(kernel));
+    kernel.type = data->type;
+    kernel.step = step;
+    kernel.length = length;
+    kernel.attack_length = envelope->attack_length;
+    kernel.attack_level = envelope->attack_level;
+    kernel.fade_length = envelope->fade_length;
+    kernel.fade_level = envelope->fade_level;
+    kernel.scale = gain * sin(data->direction * 2 * M_PI / 0x10000);
+
+    switch (data->type) {
+        case FF_CONSTANT:
+            kernel.level = data->u.constant.level;
+            break;
+        case FF_RAMP:
+            kernel.level = data->u.ramp.start_level;
+            kernel.end_level = length > 0 ? data->u.ramp.end_level : data->u.ramp.start_level;
+            break;
+        case FF_PERIODIC:
+            kernel.waveform = data->u.periodic.waveform;
+            kernel.level = data->u.periodic.magnitude;
+            kernel.offset = data->u.periodic.offset;
+            kernel.phase_step = data->u.periodic.period > 0 ? step / data->u.periodic.period : 0;
+            break;
+    }
+
+    for (first = 0; first < count; first = last) {
+        elapsed = time + first * step - effect->start;
+        last = count;
+
+        if (length == 0) {
+            // Plays until stopped
+            position = elapsed - delay;
+            if (position < 0) {
+                last = first + ceil(-position / step);
+                continue;
+            }
+        } else {
+            repetition = elapsed / (delay + length);
+            if (repetition >= effect->count) {
+                break;
+            }
+            position = elapsed - repetition * (delay + length) - delay;
+            if (position < 0) {
+                last = first + ceil(-position / step);
+                continue;
+            }
+            if (position >= length) {
+                last = first + 1;
+                continue;
+            }
+            last = first + ceil((length - position) / step);
+        }
+        if (last > count) {
+            last = count;
+        }
+        if (last <= first) {
+            last = first + 1;
+            continue;
+        }
+
+        // Only the attack needs the time of long lasting effects
+        kernel.time = length == 0 && position > 1e6 ? 1e6 : position;
+        if (data->type == FF_PERIODIC && data->u.periodic.period > 0) {
+            kernel.phase = fmod(position / data->u.periodic.period + data->u.periodic.phase / 65536.0, 1.0);
+        }
+
+        ffbt_render_kernel(&kernel, last - first, total + first,
+                contribution != NULL ? contribution + first : NULL);
+    }
+}
+
+static void ffbt_render_add_event(struct ffbt_render *render, const struct ffbt_render_event *event)
+{
+    if (render->event_count == render->event_capacity) {
+        render->event_capacity = render->event_capacity > 0 ? render->event_capacity * 2 : 1024;
+        render->events = realloc(render->events, render->event_capacity * sizeof(*render->events));
+        if (render->events == NULL) {
+            fprintf(stderr, "ERROR: out of memory\n");
+            exit(1);
+        }
+    }
+
+    render->events[render->event_count++] = *event;
+}
+
+static int ffbt_render_add_effect(struct ffbt_render *render)
+{
+    struct ffbt_render_effect *effects;
+    int *free_effects;
+
+    if (render->free_count > 0) {
+        return render->free_effects[--render->free_count];
+    }
+
+    effects = realloc(render->effects, (render->effect_count + 1) * sizeof(*effects));
+    free_effects = realloc(render->free_effects, (render->effect_count + 1) * sizeof(*free_effects));
+    if (effects == NULL || free_effects == NULL) {
+        fprintf(stderr, "ERROR: out of memory\n");
+        exit(1);
+    }
+    render->effects = effects;
+    render->free_effects = free_effects;
+    memset(&effects[render->effect_count], 0, sizeof(*effects));
+
+    return render->effect_count++;
+}
+
+static void ffbt_render_free_effect(struct ffbt_render *render, int effect)
+{
+    render->free_effects[render->free_count++] = effect;
+}
+
+/*
+ * Applies the wrapper fixes to an upload, like ffbwrap would.
+ */
+static void ffbt_render_fix(struct ffbt_render *render, struct ff_effect *effect)
+{
+    if (render->direction_fix && (effect->direction == 0 || effect->direction == 0x8000)) {
+        effect->direction = 0x4000;
+    }
+
+    if (render->offset_fix && effect->type == FF_PERIODIC) {
+        effect->u.periodic.offset = (int)effect->u.periodic.offset * 0x7fff / 10000;
+        effect->u.periodic.phase = (int)effect->u.periodic.phase * 0xffff / 35999;
+    }
+}
+
+/*
+ * Reads the commands of the log, following the effect ids the device gave
+ * to each upload. Lines commented out weren't sent to the device. Several
+ * uploads of the same call, the original and its fixes, are taken as one.
+ */
+static int ffbt_render_read(struct ffbt_render *render, struct ffbt_trace *trace)
+{
+    struct ffbt_record record;
+    struct ffbt_render_event event;
+    int *ids = NULL;
+    int id_count = 0;
+    int pending = -1;
+    int last_op = -1;
+    int result;
+    int id;
+
+    while ((result = ffbt_trace_read(trace, &record)) > 0) {
+        if (record.op == FFBT_OP_NOTE || (record.flags & FFBT_REC_COMMENTED)) {
+            continue;
+        }
+
+        memset(&event, 0, sizeof(event));
+        event.time = record.time;
+        event.op = record.op;
+        event.effect = -1;
+        id = -1;
+
+        if (record.flags & FFBT_REC_REPLY) {
+            if (record.op == FFBT_OP_UPLOAD && pending >= 0 && record.result == 0) {
+                id = record.value;
+            } else if (record.op == FFBT_OP_UPLOAD && pending >= 0) {
+                ffbt_render_free_effect(render, pending);
+                pending = -1;
+            }
+        } else if (record.op == FFBT_OP_UPLOAD) {
+            ffbt_effect_unpack(&event.data, &record.effect);
+            if (event.data.id == -1) {
+                if (pending < 0 || last_op != FFBT_OP_UPLOAD || record.tag == FFBT_TAG_NONE) {
+                    pending = ffbt_render_add_effect(render);
+                }
+                event.effect = pending;
+            } else if (event.data.id < id_count && ids[event.data.id] >= 0) {
+                event.effect = ids[event.data.id];
+            }
+            if (event.effect >= 0) {
+                ffbt_render_fix(render, &event.data);
+                ffbt_render_add_event(render, &event);
+            }
+        } else if (record.op == FFBT_OP_PLAY) {
+            if (record.aux >= 0 && record.aux < id_count && ids[record.aux] >= 0) {
+                event.effect = ids[record.aux];
+                event.value = record.value;
+                ffbt_render_add_event(render, &event);
+            }
+        } else if (record.op == FFBT_OP_REMOVE) {
+            if (record.value >= 0 && record.value < id_count && ids[record.value] >= 0) {
+                event.effect = ids[record.value];
+                ffbt_render_add_event(render, &event);
+                ffbt_render_free_effect(render, ids[record.value]);
+                ids[record.value] = -1;
+            }
+        } else if (record.op == FFBT_OP_GAIN) {
+            event.value = record.value;
+            ffbt_render_add_event(render, &event);
+        }
+
+        if (id >= 0) {
+            if (id >= id_count) {
+                ids = realloc(ids, (id + 1) * sizeof(*ids));
+                if (ids == NULL) {
+                    fprintf(stderr, "ERROR: out of memory\n");
+                    exit(1);
+                }
+                for (; id_count <= id; id_count++) {
+                    ids[id_count] = -1;
+                }
+            }
+            ids[id] = pending;
+            pending = -1;
+        }
+
+        last_op = (record.flags & FFBT_REC_REPLY) ? -1 : record.op;
+    }
+
+    free(ids);
+
+    return result;
+}
+
+/*
+ * Applies a command to the state of the effects, at the time in ms since
+ * the start of the render.
+ */
+static void ffbt_render_apply(struct ffbt_render *render, const struct ffbt_render_event *event,
+        double time, float *gain)
+{
+    struct ffbt_render_effect *effect = event->effect >= 0 ? &render->effects[event->effect] : NULL;
+
+    switch (event->op) {
+        case FFBT_OP_UPLOAD:
+            effect->data = event->data;
+            // Updating a playing effect starts it over
+            effect->start = time;
+            if (!ffbt_render_envelope(&effect->data) && effect->data.type != FF_RUMBLE) {
+                render->skipped++;
+            }
+            break;
+        case FFBT_OP_PLAY:
+            effect->playing = event->value > 0;
+            effect->count = event->value;
+            effect->start = time;
+            break;
+        case FFBT_OP_REMOVE:
+            effect->playing = false;
+            break;
+        case FFBT_OP_GAIN:
+            *gain = (float)event->value / 0xffff;
+            break;
+    }
+}
+
+/*
+ * First sample at or after the time of a command.
+ */
+static uint64_t ffbt_render_event_sample(const struct ffbt_render_event *event, double step)
+{
+    return (uint64_t)ceil(event->time / 1e6 / step);
+}
+
+/*
+ * Renders an effect over a block of samples, applying the commands of the
+ * block that change it as they come. The effect is only split at its own
+ * commands and the gain changes, the others don't cut its runs short.
+ */
+static void ffbt_render_block(struct ffbt_render *render, int index, int first_event, int last_event,
+        uint64_t sample, int count, double step, float gain, float *total, float *contribution)
+{
+    struct ffbt_render_effect *effect = &render->effects[index];
+    const struct ffbt_render_event *event;
+    int done = 0;
+    int at;
+
+    for (int i = first_event; i < last_event; i++) {
+        event = &render->events[i];
+        if (event->effect != index && event->op != FFBT_OP_GAIN) {
+            continue;
+        }
+
+        at = ffbt_render_event_sample(event, step) - sample;
+        if (at > done) {
+            if (effect->playing) {
+                ffbt_render_effect(effect, (sample + done) * step, step, at - done, gain, total + done,
+                        contribution != NULL ? contribution + done : NULL);
+            }
+            done = at;
+        }
+        ffbt_render_apply(render, event, event->time / 1e6, &gain);
+    }
+
+    if (effect->playing && count > done) {
+        ffbt_render_effect(effect, (sample + done) * step, step, count - done, gain, total + done,
+                contribution != NULL ? contribution + done : NULL);
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    struct ffbt_render render;
+    struct ffbt_trace trace;
+    FILE *input_file;
+    FILE *output_file = stdout;
+    float *total;
+    float *contributions = NULL;
+    double rate = FFBT_RENDER_DEFAULT_RATE;
+    double step;
+    double clip_start = -1;
+    float clip_peak = 0;
+    float gain = 1;
+    bool per_effect = false;
+    bool quiet = false;
+    uint64_t samples;
+    uint64_t sample = 0;
+    uint64_t clipped = 0;
+    uint64_t end;
+    int next_event = 0;
+    int last_event;
+    int count;
+    int c;
+
+    memset(&render, 0, sizeof(render));
+
+    while ((c = getopt(argc, argv, "r:edoq")) != -1) {
+        switch (c) {
+            case 'r':
+                rate = atof(optarg);
+                break;
+            case 'e':
+                per_effect = true;
+                break;
+            case 'd':
+                render.direction_fix = true;
+                break;
+            case 'o':
+                render.offset_fix = true;
+                break;
+            case 'q':
+                quiet = true;
+                break;
+            default:
+                return 1;
+        }
+    }
+
+    if (optind + 1 != argc && optind + 2 != argc) {
+        printf("Usage: %s [-r rate] [-e] [-d] [-o] [-q] <log file> [output file]\n", argv[0]);
+        printf("Renders the force commanded by the log, sampled at rate samples per second.\n");
+        exit(1);
+    }
+
+    if (rate <= 0) {
+        fprintf(stderr, "ERROR: invalid sample rate\n");
+        exit(1);
+    }
+    step = 1000 / rate;
+
+    input_file = fopen(argv[optind], "r");
+    if (input_file == NULL) {
+        fprintf(stderr, "ERROR: can not open %s (%s)\n", argv[optind], strerror(errno));
+        exit(1);
+    }
+
+    if (ffbt_trace_open_read(&trace, input_file) < 0) {
+        fprintf(stderr, "ERROR: %s is not a valid trace\n", argv[optind]);
+        exit(1);
+    }
+
+    if (ffbt_render_read(&render, &trace) < 0) {
+        fprintf(stderr, "ERROR: %s is corrupted\n", argv[optind]);
+        exit(1);
+    }
+    fclose(input_file);
+
+    if (optind + 2 == argc && strcmp(argv[optind + 1], "-") != 0) {
+        output_file = fopen(argv[optind + 1], "w");
+        if (output_file == NULL) {
+            fprintf(stderr, "ERROR: can not open %s (%s)\n", argv[optind + 1], strerror(errno));
+            exit(1);
+        }
+    }
+
+    total = aligned_alloc(sizeof(ffbt_vf), (FFBT_RENDER_BLOCK + FFBT_RENDER_LANES) * sizeof(float));
+    if (per_effect && render.effect_count > 0) {
+        contributions = aligned_alloc(sizeof(ffbt_vf),
+                render.effect_count * (FFBT_RENDER_BLOCK + FFBT_RENDER_LANES) * sizeof(float));
+    }
+    if (total == NULL || (per_effect && render.effect_count > 0 && contributions == NULL)) {
+        fprintf(stderr, "ERROR: out of memory\n");
+        exit(1);
+    }
+
+    end = render.event_count > 0 ? render.events[render.event_count - 1].time : 0;
+    samples = (uint64_t)(end / 1e6 / step) + 1;
+
+    if (!quiet) {
+        fprintf(output_file, "time,force");
+        for (int i = 0; per_effect && i < render.effect_count; i++) {
+            fprintf(output_file, ",effect %d", i);
+        }
+        fprintf(output_file, "\n");
+    }
+
+    while (sample < samples) {
+        count = FFBT_RENDER_BLOCK;
+        if (samples - sample < (uint64_t)count) {
+            count = samples - sample;
+        }
+
+        // Commands up to the end of the block
+        last_event = next_event;
+        while (last_event < render.event_count &&
+                ffbt_render_event_sample(&render.events[last_event], step) < sample + count) {
+            last_event++;
+        }
+
+        memset(total, 0, (count + FFBT_RENDER_LANES) * sizeof(float));
+        for (int i = 0; i < render.effect_count; i++) {
+            float *contribution = NULL;
+
+            if (contributions != NULL) {
+                contribution = contributions + i * (FFBT_RENDER_BLOCK + FFBT_RENDER_LANES);
+                memset(contribution, 0, (count + FFBT_RENDER_LANES) * sizeof(float));
+            }
+            ffbt_render_block(&render, i, next_event, last_event, sample, count, step, gain, total, contribution);
+        }
+
+        // The gain changes apply to every effect, the last one stays
+        for (; next_event < last_event; next_event++) {
+            if (render.events[next_event].op == FFBT_OP_GAIN) {
+                ffbt_render_apply(&render, &render.events[next_event], 0, &gain);
+            }
+        }
+
+        for (int j = 0; j < count; j++) {
+            double sample_time = (sample + j) * step;
+            bool clipping = fabsf(total[j]) > FFBT_RENDER_MAX_FORCE;
+
+            if (clipping) {
+                clipped++;
+                if (clip_start < 0) {
+                    clip_start = sample_time;
+                    clip_peak = 0;
+                }
+                if (fabsf(total[j]) > clip_peak) {
+                    clip_peak = fabsf(total[j]);
+                }
+            } else if (clip_start >= 0) {
+                fprintf(stderr, "Clipping from %.3f s to %.3f s, peak %.0f\n", clip_start / 1000,
+                        sample_time / 1000, clip_peak);
+                clip_start = -1;
+            }
+
+            for (int i = 0; contributions != NULL && i < render.effect_count; i++) {
+                float force = contributions[i * (FFBT_RENDER_BLOCK + FFBT_RENDER_LANES) + j];
+
+                if (fabsf(force) > render.effects[i].peak) {
+                    render.effects[i].peak = fabsf(force);
+                }
+                if (clipping) {
+                    render.effects[i].clipped_sum += fabsf(force);
+                }
+            }
+
+            if (!quiet) {
+                fprintf(output_file, "%.6f,%.0f", sample_time / 1000, total[j]);
+                for (int i = 0; contributions != NULL && i < render.effect_count; i++) {
+                    fprintf(output_file, ",%.0f", contributions[i * (FFBT_RENDER_BLOCK + FFBT_RENDER_LANES) + j]);
+                }
+                fprintf(output_file, "\n");
+            }
+        }
+
+        sample += count;
+    }
+
+    if (clip_start >= 0) {
+        fprintf(stderr, "Clipping from %.3f s to %.3f s, peak %.0f\n", clip_start / 1000,
+                samples * step / 1000, clip_peak);
+    }
+
+    fprintf(stderr, "Rendered %lu samples, %lu clipping (%.2f%%)\n", (unsigned long)samples,
+            (unsigned long)clipped, samples > 0 ? 100.0 * clipped / samples : 0);
+    for (int i = 0; contributions != NULL && i < render.effect_count; i++) {
+        fprintf(stderr, "Effect %d: peak %.0f, average while clipping %.0f\n", i, render.effects[i].peak,
+                clipped > 0 ? render.effects[i].clipped_sum / clipped : 0);
+    }
+    if (render.skipped > 0) {
+        fprintf(stderr, "%d condition effect uploads aren't rendered\n", render.skipped);
+    }
+
+    if (output_file != stdout && fclose(output_file) != 0) {
+        fprintf(stderr, "ERROR: can not write %s (%s)\n", argv[optind + 1], strerror(errno));
+        exit(1);
+    }
+
+    return 0;
+}
@@ -0,0 +1,151 @@
+/*
+ *
+ * ffbstats.h
+ *
+ * Live statistics published by libffbwrapper in shared memory
+ *
+ * Copyright 2019 Bernat Arlandis <bernat@hotmail.com>
+ */
+
+/*
+ * This file is part of ffbtools.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef FFBSTATS_H
+#define FFBSTATS_H
+
+#include <stdatomic.h>
+#include <stdint.h>
+#include <linux/input.h>
+
+#define FFBT_STATS_MAGIC "FFBSTATS"
+#define FFBT_STATS_VERSION (1)
+
+/* Segments are named after the process id and the device index */
+#define FFBT_STATS_PREFIX "ffbtools."
+#define FFBT_STATS_NAME "/" FFBT_STATS_PREFIX "%d.%d"
+
+/*
+ * Latency histogram buckets. Values below 16 ns have their own bucket and
+ * every power of two above is split in 16, so buckets are within 6% of the
+ * value, up to 2^40 ns.
+ */
+#define FFBT_LATENCY_SUB_BUCKETS (16)
+#define FFBT_LATENCY_BUCKETS (37 * FFBT_LATENCY_SUB_BUCKETS)
+
+/*
+ * Device calls timed, the effect types follow them.
+ */
+enum ffbt_call {
+    FFBT_CALL_UPLOAD = 0,
+    FFBT_CALL_PLAY,
+    FFBT_CALL_STOP,
+    FFBT_CALL_REMOVE,
+    FFBT_CALL_GAIN,
+    FFBT_CALL_AUTOCENTER,
+    FFBT_CALLS,
+};
+
+#define FFBT_LATENCY_HISTOGRAMS (FFBT_CALLS + FF_EFFECT_MAX - FF_EFFECT_MIN + 1)
+
+/*
+ * Histogram of the time taken by the driver, in ns. Threads add to it
+ * without locking.
+ */
+struct ffbt_latency {
+    _Atomic uint64_t count;
+    _Atomic uint64_t max;
+    _Atomic uint64_t buckets[FFBT_LATENCY_BUCKETS];
+};
+
+/*
+ * Counters of a device. Command counts are the calls made by the
+ * application, the latency histograms count the calls that reached the
+ * driver. The layout is the same in 32 and 64 bits builds.
+ */
+struct ffbt_stats {
+    char magic[8];
+    uint32_t version;
+    int32_t pid;
+    int32_t index;
+    uint32_t major;
+    uint32_t minor;
+    uint32_t reserved;
+    uint64_t start_time;
+    char name[64];
+
+    _Atomic uint64_t commands[FFBT_CALLS];
+    _Atomic uint64_t throttled;
+    _Atomic uint64_t coalesced;
+    _Atomic uint64_t suppressed;
+    _Atomic uint64_t rendered;
+    _Atomic uint64_t errors;
+    _Atomic uint64_t queue_depth;
+    _Atomic uint64_t queue_depth_max;
+
+    struct ffbt_latency latency[FFBT_LATENCY_HISTOGRAMS];
+};
+
+static inline int ffbt_latency_bucket(uint64_t value)
+{
+    int exponent;
+
+    if (value < FFBT_LATENCY_SUB_BUCKETS) {
+        return value;
+    }
+
+    exponent = 63 - __builtin_clzll(value);
+    if (exponent > 39) {
+        return FFBT_LATENCY_BUCKETS - 1;
+    }
+
+    return (exponent - 3) * FFBT_LATENCY_SUB_BUCKETS + ((value >> (exponent - 4)) & (FFBT_LATENCY_SUB_BUCKETS - 1));
+}
+
+/*
+ * Highest value that falls in a bucket.
+ */
+static inline uint64_t ffbt_latency_bucket_value(int bucket)
+{
+    int exponent = bucket / FFBT_LATENCY_SUB_BUCKETS + 3;
+    int sub_bucket = bucket % FFBT_LATENCY_SUB_BUCKETS;
+
+    if (bucket < FFBT_LATENCY_SUB_BUCKETS) {
+        return bucket;
+    }
+
+    return ((uint64_t)(FFBT_LATENCY_SUB_BUCKETS + sub_bucket + 1) << (exponent - 4)) - 1;
+}
+
+/*
+ * Value below which a fraction of the counts in the buckets are.
+ */
+static inline uint64_t ffbt_latency_percentile(const uint64_t *buckets, uint64_t count, double fraction)
+{
+    uint64_t total = 0;
+    int bucket;
+
+    for (bucket = 0; bucket < FFBT_LATENCY_BUCKETS - 1; bucket++) {
+        total += buckets[bucket];
+        if (total >= fraction * count) {
+            break;
+        }
+    }
+
+    return ffbt_latency_bucket_value(bucket);
+}
+
+#endif
@@ -0,0 +1,299 @@
+/*
+ *
+ * ffbtop.c
+ *
+ * Shows the live statistics published by libffbwrapper
+ *
+ * Copyright 2019 Bernat Arlandis <bernat@hotmail.com>
+ */
+
+/*
+ * This file is part of ffbtools.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "ffbstats.h"
+
+#define FFBTOP_MAX_SEGMENTS (32)
+
+/*
+ * A mapped segment and the counters read from it last time, to work out
+ * the rates.
+ */
+struct ffbt_segment {
+    char name[NAME_MAX + 1];
+    const struct ffbt_stats *stats;
+    struct ffbt_stats *last;
+    bool seen;
+};
+
+static struct ffbt_segment segments[FFBTOP_MAX_SEGMENTS];
+static int segment_count = 0;
+
+static uint64_t ffbt_clock()
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+/*
+ * Copies the counters, they're changing while being read so they don't
+ * need to be consistent with each other.
+ */
+static void ffbt_snapshot(struct ffbt_stats *copy, const struct ffbt_stats *stats)
+{
+    memcpy(copy, stats, sizeof(*copy));
+}
+
+static void ffbt_open_segment(const char *name, pid_t pid)
+{
+    struct ffbt_segment *segment;
+    const struct ffbt_stats *stats;
+    char path[NAME_MAX + 2];
+    int fd;
+
+    for (int i = 0; i < segment_count; i++) {
+        if (!strcmp(segments[i].name, name)) {
+            segments[i].seen = true;
+            return;
+        }
+    }
+
+    if (segment_count == FFBTOP_MAX_SEGMENTS) {
+        return;
+    }
+
+    snprintf(path, sizeof(path), "/%s", name);
+    fd = shm_open(path, O_RDONLY, 0);
+    if (fd < 0) {
+        return;
+    }
+
+    stats = mmap(NULL, sizeof(*stats), PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (stats == MAP_FAILED) {
+        return;
+    }
+
+    if (memcmp(stats->magic, FFBT_STATS_MAGIC, sizeof(stats->magic)) ||
+            stats->version != FFBT_STATS_VERSION || stats->pid != pid) {
+        munmap((void*) stats, sizeof(*stats));
+        return;
+    }
+
+    segment = &segments[segment_count];
+    segment->last = malloc(sizeof(*segment->last));
+    if (segment->last == NULL) {
+        munmap((void*) stats, sizeof(*stats));
+        return;
+    }
+    snprintf(segment->name, sizeof(segment->name), "%s", name);
+    segment->stats = stats;
+    segment->seen = true;
+    ffbt_snapshot(segment->last, stats);
+    segment_count++;
+}
+
+static void ffbt_remove_segment(const char *name)
+{
+    char path[NAME_MAX + 2];
+
+    snprintf(path, sizeof(path), "/%s", name);
+    shm_unlink(path);
+}
+
+/*
+ * Maps the segments of new processes and drops the ones of processes that
+ * have finished. Segments left behind by crashed processes are removed.
+ */
+static void ffbt_scan_segments(pid_t only_pid)
+{
+    struct dirent *entry;
+    DIR *dir;
+    int pid;
+    int index;
+    int kept = 0;
+
+    for (int i = 0; i < segment_count; i++) {
+        segments[i].seen = false;
+    }
+
+    dir = opendir("/dev/shm");
+    if (dir != NULL) {
+        while ((entry = readdir(dir)) != NULL) {
+            if (sscanf(entry->d_name, FFBT_STATS_PREFIX "%d.%d", &pid, &index) != 2) {
+                continue;
+            }
+            if (kill(pid, 0) != 0 && errno == ESRCH) {
+                ffbt_remove_segment(entry->d_name);
+                continue;
+            }
+            if (only_pid != 0 && pid != only_pid) {
+                continue;
+            }
+            ffbt_open_segment(entry->d_name, pid);
+        }
+        closedir(dir);
+    }
+
+    for (int i = 0; i < segment_count; i++) {
+        if (segments[i].seen && kill(segments[i].stats->pid, 0) == 0) {
+            segments[kept++] = segments[i];
+        } else {
+            munmap((void*) segments[i].stats, sizeof(*segments[i].stats));
+            free(segments[i].last);
+        }
+    }
+    segment_count = kept;
+}
+
+static double ffbt_rate(uint64_t now, uint64_t last, double elapsed)
+{
+    return (now - last) / elapsed;
+}
+
+/*
+ * Prints the rates since the last time, and the latency percentiles of the
+ * driver calls made meanwhile.
+ */
+static void ffbt_print_segment(struct ffbt_segment *segment, double elapsed)
+{
+    struct ffbt_stats *now = malloc(sizeof(*now));
+    struct ffbt_stats *last = segment->last;
+    uint64_t buckets[FFBT_LATENCY_BUCKETS];
+    uint64_t count = 0;
+    uint64_t max = 0;
+
+    if (now == NULL) {
+        return;
+    }
+    ffbt_snapshot(now, segment->stats);
+
+    memset(buckets, 0, sizeof(buckets));
+    for (int call = 0; call < FFBT_CALLS; call++) {
+        for (int bucket = 0; bucket < FFBT_LATENCY_BUCKETS; bucket++) {
+            buckets[bucket] += now->latency[call].buckets[bucket] - last->latency[call].buckets[bucket];
+        }
+        count += now->latency[call].count - last->latency[call].count;
+        if (now->latency[call].max > max) {
+            max = now->latency[call].max;
+        }
+    }
+
+    printf("%7d %3d  %-24.24s %7.0f %7.0f %7.0f %7.0f %7.0f %7.0f %7.0f %5lu %5lu %7.0f ",
+            now->pid, now->index, now->name[0] ? now->name : "-",
+            ffbt_rate(now->commands[FFBT_CALL_UPLOAD], last->commands[FFBT_CALL_UPLOAD], elapsed),
+            ffbt_rate(now->commands[FFBT_CALL_PLAY], last->commands[FFBT_CALL_PLAY], elapsed),
+            ffbt_rate(now->commands[FFBT_CALL_STOP], last->commands[FFBT_CALL_STOP], elapsed),
+            ffbt_rate(now->throttled, last->throttled, elapsed),
+            ffbt_rate(now->coalesced, last->coalesced, elapsed),
+            ffbt_rate(now->suppressed, last->suppressed, elapsed),
+            ffbt_rate(now->errors, last->errors, elapsed),
+            (unsigned long) now->queue_depth, (unsigned long) now->queue_depth_max,
+            count / elapsed);
+    if (count > 0) {
+        printf("%7.1f %7.1f", ffbt_latency_percentile(buckets, count, 0.5) / 1e3,
+                ffbt_latency_percentile(buckets, count, 0.99) / 1e3);
+    } else {
+        printf("%7s %7s", "-", "-");
+    }
+    printf(" %7.1f\n", max / 1e3);
+
+    free(segment->last);
+    segment->last = now;
+}
+
+int main(int argc, char *argv[])
+{
+    double interval = 1;
+    int iterations = 0;
+    bool batch = false;
+    pid_t pid = 0;
+    uint64_t last_time;
+    uint64_t now;
+    struct timespec sleep_time;
+    int c;
+
+    while ((c = getopt(argc, argv, "d:n:b")) != -1) {
+        switch (c) {
+            case 'd':
+                interval = atof(optarg);
+                break;
+            case 'n':
+                iterations = atoi(optarg);
+                break;
+            case 'b':
+                batch = true;
+                break;
+            default:
+                return 1;
+        }
+    }
+
+    if (interval <= 0 || optind + 1 < argc) {
+        printf("Usage: %s [-d seconds] [-n iterations] [-b] [pid]\n", argv[0]);
+        exit(1);
+    }
+
+    if (optind < argc) {
+        pid = atoi(argv[optind]);
+    }
+
+    sleep_time.tv_sec = interval;
+    sleep_time.tv_nsec = (interval - sleep_time.tv_sec) * 1e9;
+
+    ffbt_scan_segments(pid);
+    last_time = ffbt_clock();
+
+    for (int i = 0; iterations == 0 || i < iterations; i++) {
+        nanosleep(&sleep_time, NULL);
+        now = ffbt_clock();
+
+        if (!batch) {
+            printf("\033[H\033[2J");
+        }
+        printf("%7s %3s  %-24s %7s %7s %7s %7s %7s %7s %7s %5s %5s %7s %7s %7s %7s\n",
+                "PID", "DEV", "NAME", "UPLOAD", "PLAY", "STOP", "THROTL", "MERGED", "SUPPR",
+                "ERRORS", "QUEUE", "QMAX", "CALLS", "P50 us", "P99 us", "MAX us");
+        for (int j = 0; j < segment_count; j++) {
+            ffbt_print_segment(&segments[j], (now - last_time) / 1e9);
+        }
+        if (batch) {
+            printf("\n");
+        }
+        fflush(stdout);
+
+        last_time = now;
+        ffbt_scan_segments(pid);
+    }
+
+    return 0;
+}
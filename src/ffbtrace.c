@@ -0,0 +1,1026 @@
+/*
+ *
+ * ffbtrace.c
+ *
+ * FFB trace records and their text and binary log formats
+ *
+ * Copyright 2019 Bernat Arlandis <bernat@hotmail.com>
+ */
+
+/*
+ * This file is part of ffbtools.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#define _GNU_SOURCE
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#define ioctl ioctl_trash_function
+#include <linux/input.h>
+#undef ioctl
+
+#include "ffbtrace.h"
+
+#define testBit(bit, array) ((array[bit/8] >> bit%8) & 1)
+#define setBit(bit, array) (array[bit/8] |= 1 << bit%8)
+
+/* Words of struct ffbt_effect compared when delta encoding uploads */
+#define FFBT_EFFECT_WORDS (sizeof(struct ffbt_effect) / sizeof(uint16_t))
+
+/* The upload only has the words that changed from the last one for the id */
+#define FFBT_ENTRY_DELTA (1 << 7)
+
+/*
+ * Binary traces are a header followed by entries. Every entry has this fixed
+ * part followed by a payload depending on the op: the effect for uploads,
+ * the feature bits for query replies and the text for comments. Payloads can
+ * be longer than needed, padded traces use it to align entries to 8 bytes
+ * and skip the zeroed space between them.
+ */
+struct ffbt_trace_entry {
+    uint64_t time;
+    uint8_t op;
+    uint8_t flags;
+    uint8_t tag;
+    uint8_t dev;
+    int32_t fd;
+    int32_t result;
+    int32_t value;
+    int32_t aux;
+    uint16_t payload_size;
+    uint16_t reserved;
+};
+
+_Static_assert(sizeof(struct ffbt_effect) == 40, "struct ffbt_effect has padding");
+_Static_assert(sizeof(struct ffbt_trace_entry) == 32, "struct ffbt_trace_entry has padding");
+_Static_assert(sizeof(struct ffbt_trace_header) == 256, "struct ffbt_trace_header has padding");
+
+static const char *tag_names[] = {
+    [FFBT_TAG_DURATION_FIX] = "duration fix",
+    [FFBT_TAG_DIRECTION_FIX] = "direction fix",
+    [FFBT_TAG_FORCE_INVERSION] = "force inversion fix",
+    [FFBT_TAG_OFFSET_FIX] = "offset fix",
+    [FFBT_TAG_UPDATE_FIX] = "update fix",
+    [FFBT_TAG_FEATURES_HACK] = "features hack",
+    [FFBT_TAG_IGNORED] = "ignored",
+    [FFBT_TAG_SUPPRESSED] = "suppressed",
+    [FFBT_TAG_RENDERED] = "rendered",
+};
+
+static const struct {
+    int bit;
+    const char *name;
+} feature_names[] = {
+    {FF_CONSTANT, "Constant"},
+    {FF_PERIODIC, "Periodic"},
+    {FF_SQUARE, "Square"},
+    {FF_TRIANGLE, "Triangle"},
+    {FF_SINE, "Sine"},
+    {FF_SAW_UP, "Saw up"},
+    {FF_SAW_DOWN, "Saw down"},
+    {FF_CUSTOM, "Custom"},
+    {FF_RAMP, "Ramp"},
+    {FF_SPRING, "Spring"},
+    {FF_FRICTION, "Friction"},
+    {FF_DAMPER, "Damper"},
+    {FF_RUMBLE, "Rumble"},
+    {FF_INERTIA, "Inertia"},
+    {FF_GAIN, "Gain"},
+    {FF_AUTOCENTER, "Autocenter"},
+};
+
+struct ffbt_effect ffbt_effect_pack(const struct ff_effect *effect)
+{
+    struct ffbt_effect packed = {
+        .type = effect->type,
+        .id = effect->id,
+        .direction = effect->direction,
+        .trigger_button = effect->trigger.button,
+        .trigger_interval = effect->trigger.interval,
+        .replay_length = effect->replay.length,
+        .replay_delay = effect->replay.delay,
+    };
+
+    memcpy(packed.u, &effect->u, sizeof(packed.u));
+
+    return packed;
+}
+
+void ffbt_effect_unpack(struct ff_effect *effect, const struct ffbt_effect *packed)
+{
+    memset(effect, 0, sizeof(*effect));
+    effect->type = packed->type;
+    effect->id = packed->id;
+    effect->direction = packed->direction;
+    effect->trigger.button = packed->trigger_button;
+    effect->trigger.interval = packed->trigger_interval;
+    effect->replay.length = packed->replay_length;
+    effect->replay.delay = packed->replay_delay;
+    memcpy(&effect->u, packed->u, sizeof(packed->u));
+}
+
+void ffbt_init_effect(struct ff_effect *effect)
+{
+    effect->id = -1;
+    effect->trigger.button = 0;
+    effect->trigger.interval = 0;
+    effect->replay.length = 0;
+    effect->replay.delay = 0;
+    effect->direction = 0x4000;
+    switch (effect->type) {
+        case FF_CONSTANT:
+            effect->u.constant.level = 0x6000;
+            effect->u.constant.envelope.attack_length = 0;
+            effect->u.constant.envelope.attack_level = 0;
+            effect->u.constant.envelope.fade_length = 0;
+            effect->u.constant.envelope.fade_level = 0;
+            break;
+        case FF_RAMP:
+            effect->u.ramp.start_level = 0x0000;
+            effect->u.ramp.end_level = 0x6000;
+            effect->u.ramp.envelope.attack_length = 0;
+            effect->u.ramp.envelope.attack_level = 0;
+            effect->u.ramp.envelope.fade_length = 0;
+            effect->u.ramp.envelope.fade_level = 0;
+            break;
+        case FF_PERIODIC:
+            effect->u.periodic.period = 1000;
+            effect->u.periodic.magnitude = 0x6000;
+            effect->u.periodic.offset = 0;
+            effect->u.periodic.phase = 0;
+            effect->u.periodic.envelope.attack_length = 0;
+            effect->u.periodic.envelope.attack_level = 0;
+            effect->u.periodic.envelope.fade_length = 0;
+            effect->u.periodic.envelope.fade_level = 0;
+            break;
+        case FF_SPRING:
+        case FF_DAMPER:
+        case FF_FRICTION:
+        case FF_INERTIA:
+            effect->u.condition[0].left_saturation = 0xffff;
+            effect->u.condition[0].right_saturation = 0xffff;
+            effect->u.condition[0].left_coeff = 0x4000;
+            effect->u.condition[0].right_coeff = 0x4000;
+            effect->u.condition[0].deadband = 0;
+            effect->u.condition[0].center = 0;
+            break;
+        case FF_RUMBLE:
+            effect->u.rumble.strong_magnitude = 0x6000;
+            effect->u.rumble.weak_magnitude = 0x2000;
+            break;
+    }
+}
+
+void ffbt_parse_effect(struct ff_effect *effect, char *params)
+{
+    char *next_param;
+    char *param;
+    char *key;
+    char *value;
+    int nvalue;
+
+    memset(effect, 0, sizeof(*effect));
+
+    value = strstr(params, "type:");
+    if (value != NULL) {
+        value += 5;
+        if (strstr(value, "CONSTANT") == value) {
+            effect->type = FF_CONSTANT;
+        } else if (strstr(value, "RAMP") == value) {
+            effect->type = FF_RAMP;
+        } else if (strstr(value, "SPRING") == value) {
+            effect->type = FF_SPRING;
+        } else if (strstr(value, "DAMPER") == value) {
+            effect->type = FF_DAMPER;
+        } else if (strstr(value, "FRICTION") == value) {
+            effect->type = FF_FRICTION;
+        } else if (strstr(value, "INERTIA") == value) {
+            effect->type = FF_INERTIA;
+        } else if (strstr(value, "PERIODIC") == value) {
+            effect->type = FF_PERIODIC;
+        } else if (strstr(value, "RUMBLE") == value) {
+            effect->type = FF_RUMBLE;
+        }
+    }
+
+    ffbt_init_effect(effect);
+
+    for(; (param = strtok_r(params, " ", &next_param)); params = NULL) {
+        key = strtok_r(param, ":", &value);
+        // Older logs separate some parameters with commas
+        if (value[0] != '\0' && value[strlen(value) - 1] == ',') {
+            value[strlen(value) - 1] = '\0';
+        }
+        if (effect->type == FF_PERIODIC && !strcmp(key, "waveform")) {
+            if (!strcmp(value, "SINE")) {
+                effect->u.periodic.waveform = FF_SINE;
+            } else if (!strcmp(value, "SQUARE")) {
+                effect->u.periodic.waveform = FF_SQUARE;
+            } else if (!strcmp(value, "TRIANGLE")) {
+                effect->u.periodic.waveform = FF_TRIANGLE;
+            } else if (!strcmp(value, "SAW_UP")) {
+                effect->u.periodic.waveform = FF_SAW_UP;
+            } else if (!strcmp(value, "SAW_DOWN")) {
+                effect->u.periodic.waveform = FF_SAW_DOWN;
+            } else if (!strcmp(value, "CUSTOM")) {
+                effect->u.periodic.waveform = FF_CUSTOM;
+            }
+        } else {
+            nvalue = strtol(value, NULL, 0);
+            if (!strcmp(key, "id")) {
+                effect->id = nvalue;
+            } else if (!strcmp(key, "length")) {
+                effect->replay.length = nvalue;
+            } else if (!strcmp(key, "delay")) {
+                effect->replay.delay = nvalue;
+            } else if (!strcmp(key, "dir")) {
+                effect->direction = nvalue;
+            } else {
+                switch (effect->type) {
+                    case FF_CONSTANT:
+                        if (!strcmp(key, "level")) {
+                            effect->u.constant.level = nvalue;
+                        }
+                        break;
+                    case FF_RAMP:
+                        if (!strcmp(key, "start_level")) {
+                            effect->u.ramp.start_level = nvalue;
+                        } else if (!strcmp(key, "end_level")) {
+                            effect->u.ramp.end_level = nvalue;
+                        }
+                        break;
+                    case FF_SPRING:
+                        if (!strcmp(key, "deadband")) {
+                            effect->u.condition[0].deadband = nvalue;
+                        } else if (!strcmp(key, "center")) {
+                            effect->u.condition[0].center = nvalue;
+                        }
+                        // fall through
+                    case FF_DAMPER:
+                    case FF_FRICTION:
+                    case FF_INERTIA:
+                        if (!strcmp(key, "left_saturation")) {
+                            effect->u.condition[0].left_saturation = nvalue;
+                        } else if (!strcmp(key, "right_saturation")) {
+                            effect->u.condition[0].right_saturation = nvalue;
+                        } else if (!strcmp(key, "left_coeff")) {
+                            effect->u.condition[0].left_coeff = nvalue;
+                        } else if (!strcmp(key, "right_coeff")) {
+                            effect->u.condition[0].right_coeff = nvalue;
+                        }
+                        break;
+                    case FF_RUMBLE:
+                        if (!strcmp(key, "strong") || !strcmp(key, "strong_rumble")) {
+                            effect->u.rumble.strong_magnitude = nvalue;
+                        } else if (!strcmp(key, "weak") || !strcmp(key, "weak_rumble")) {
+                            effect->u.rumble.weak_magnitude = nvalue;
+                        }
+                        break;
+                    case FF_PERIODIC:
+                        if (!strcmp(key, "period")) {
+                            effect->u.periodic.period = nvalue;
+                        } else if (!strcmp(key, "magnitude")) {
+                            effect->u.periodic.magnitude = nvalue;
+                        } else if (!strcmp(key, "offset")) {
+                            effect->u.periodic.offset = nvalue;
+                        } else if (!strcmp(key, "phase")) {
+                            effect->u.periodic.phase = nvalue;
+                        }
+                        break;
+                }
+                switch (effect->type) {
+                    case FF_CONSTANT:
+                    case FF_RAMP:
+                    case FF_PERIODIC:
+                        {
+                            struct ff_envelope *envelope = effect->type == FF_CONSTANT ?
+                                &effect->u.constant.envelope : effect->type == FF_RAMP ?
+                                &effect->u.ramp.envelope : &effect->u.periodic.envelope;
+                            if (!strcmp(key, "attack_length")) {
+                                envelope->attack_length = nvalue;
+                            } else if (!strcmp(key, "attack_level")) {
+                                envelope->attack_level = nvalue;
+                            } else if (!strcmp(key, "fade_length")) {
+                                envelope->fade_length = nvalue;
+                            } else if (!strcmp(key, "fade_level")) {
+                                envelope->fade_level = nvalue;
+                            }
+                        }
+                        break;
+                }
+            }
+        }
+    }
+}
+
+static const char *ffbt_effect_type_name(const struct ff_effect *effect)
+{
+    switch (effect->type) {
+        case FF_RUMBLE:
+            return "RUMBLE";
+        case FF_CONSTANT:
+            return "CONSTANT";
+        case FF_RAMP:
+            return "RAMP";
+        case FF_PERIODIC:
+            return "PERIODIC";
+        case FF_SPRING:
+            return "SPRING";
+        case FF_FRICTION:
+            return "FRICTION";
+        case FF_DAMPER:
+            return "DAMPER";
+        case FF_INERTIA:
+            return "INERTIA";
+    }
+
+    return "UNKNOWN";
+}
+
+static const char *ffbt_waveform_name(const struct ff_effect *effect)
+{
+    switch (effect->u.periodic.waveform) {
+        case FF_SQUARE:
+            return "SQUARE";
+        case FF_TRIANGLE:
+            return "TRIANGLE";
+        case FF_SINE:
+            return "SINE";
+        case FF_SAW_UP:
+            return "SAW_UP";
+        case FF_SAW_DOWN:
+            return "SAW_DOWN";
+        case FF_CUSTOM:
+            return "CUSTOM";
+    }
+
+    return "UNKNOWN";
+}
+
+static void ffbt_format_effect_params(char *string, size_t size, const struct ff_effect *effect)
+{
+    string[0] = '\0';
+
+    switch (effect->type) {
+        case FF_RUMBLE:
+            snprintf(string, size,
+                    "strong:%u, weak:%u",
+                    effect->u.rumble.strong_magnitude,
+                    effect->u.rumble.weak_magnitude);
+            break;
+        case FF_CONSTANT:
+            snprintf(string, size,
+                    "level:%d attack_length:%u attack_level:%u "
+                    "fade_length:%u fade_level:%u",
+                    effect->u.constant.level,
+                    effect->u.constant.envelope.attack_length,
+                    effect->u.constant.envelope.attack_level,
+                    effect->u.constant.envelope.fade_length,
+                    effect->u.constant.envelope.fade_level);
+            break;
+        case FF_RAMP:
+            snprintf(string, size,
+                    "start_level:%d end_level:%d attack_length:%u "
+                    "attack_level:%u fade_length:%u fade_level:%u",
+                    effect->u.ramp.start_level,
+                    effect->u.ramp.end_level,
+                    effect->u.ramp.envelope.attack_length,
+                    effect->u.ramp.envelope.attack_level,
+                    effect->u.ramp.envelope.fade_length,
+                    effect->u.ramp.envelope.fade_level);
+            break;
+        case FF_PERIODIC:
+            snprintf(string, size,
+                    "waveform:%s period:%u magnitude:%d offset:%d "
+                    "phase:%u attack_length:%u attack_level:%u "
+                    "fade_length:%u fade_level:%u",
+                    ffbt_waveform_name(effect), effect->u.periodic.period,
+                    effect->u.periodic.magnitude,
+                    effect->u.periodic.offset,
+                    effect->u.periodic.phase,
+                    effect->u.periodic.envelope.attack_length,
+                    effect->u.periodic.envelope.attack_level,
+                    effect->u.periodic.envelope.fade_length,
+                    effect->u.periodic.envelope.fade_level);
+            break;
+        case FF_SPRING:
+        case FF_FRICTION:
+        case FF_DAMPER:
+        case FF_INERTIA:
+            snprintf(string, size,
+                    "right_saturation:%u left_saturation:%u right_coeff:%d "
+                    "left_coeff:%d deadband:%u center:%d",
+                    effect->u.condition[0].right_saturation,
+                    effect->u.condition[0].left_saturation,
+                    effect->u.condition[0].right_coeff,
+                    effect->u.condition[0].left_coeff,
+                    effect->u.condition[0].deadband,
+                    effect->u.condition[0].center);
+            break;
+    }
+}
+
+static void ffbt_format_features(char *string, const uint8_t *features)
+{
+    strcpy(string, "");
+    if (testBit(FF_CONSTANT, features)) strcat(string, " Constant");
+    if (testBit(FF_PERIODIC, features)) {
+        strcat(string, " Periodic (");
+        if (testBit(FF_SQUARE, features)) strcat(string, " Square");
+        if (testBit(FF_TRIANGLE, features)) strcat(string, " Triangle");
+        if (testBit(FF_SINE, features)) strcat(string, " Sine");
+        if (testBit(FF_SAW_UP, features)) strcat(string, " Saw up");
+        if (testBit(FF_SAW_DOWN, features)) strcat(string, " Saw down");
+        if (testBit(FF_CUSTOM, features)) strcat(string, " Custom");
+        strcat(string, " )");
+    }
+    if (testBit(FF_RAMP, features)) strcat(string, " Ramp");
+    if (testBit(FF_SPRING, features)) strcat(string, " Spring");
+    if (testBit(FF_FRICTION, features)) strcat(string, " Friction");
+    if (testBit(FF_DAMPER, features)) strcat(string, " Damper");
+    if (testBit(FF_RUMBLE, features)) strcat(string, " Rumble");
+    if (testBit(FF_INERTIA, features)) strcat(string, " Inertia");
+    if (testBit(FF_GAIN, features)) strcat(string, " Gain");
+    if (testBit(FF_AUTOCENTER, features)) strcat(string, " Autocenter");
+}
+
+/*
+ * Formats a record as a log line without the timestamp.
+ */
+void ffbt_format_record(char *string, size_t size, const struct ffbt_record *record, const char *comment)
+{
+    char params[256];
+    struct ff_effect effect;
+    const char *prefix;
+    int length;
+
+    if (record->flags & FFBT_REC_REPLY) {
+        prefix = record->flags & FFBT_REC_COMMENTED ? "#<" : "<";
+    } else {
+        prefix = record->flags & FFBT_REC_COMMENTED ? "#>" : ">";
+    }
+
+    switch (record->op) {
+        case FFBT_OP_NOTE:
+            if (record->tag == FFBT_TAG_CANNOT_THROTTLE) {
+                snprintf(string, size, "# cannot throttle effect, id too large (%d > %d)",
+                        record->value, record->aux);
+            } else if (record->tag == FFBT_TAG_DROPPED) {
+                snprintf(string, size, "# logger dropped %d records", record->value);
+            } else if (record->tag == FFBT_TAG_SUPPRESSED) {
+                snprintf(string, size, "# suppressed %d redundant uploads", record->value);
+            } else if (record->tag == FFBT_TAG_RENDERED) {
+                snprintf(string, size, "# rendered %d condition ticks, max latency %d us",
+                        record->value, record->aux);
+            } else if (comment != NULL && comment[0] != '\0') {
+                snprintf(string, size, "# %s", comment);
+            } else {
+                snprintf(string, size, "#");
+            }
+            return;
+        case FFBT_OP_QUERY:
+            if (record->flags & FFBT_REC_REPLY) {
+                ffbt_format_features(params, record->features);
+                length = snprintf(string, size, "%s %d, %s", prefix, record->result, params);
+            } else {
+                length = snprintf(string, size, "%s QUERY # Query force feedback features.", prefix);
+            }
+            break;
+        case FFBT_OP_SLOTS:
+            if (record->flags & FFBT_REC_REPLY) {
+                length = snprintf(string, size, "%s %d, effects: %d", prefix, record->result, record->value);
+            } else {
+                length = snprintf(string, size, "%s SLOTS # Get maximum number of simultaneous effects in memory.", prefix);
+            }
+            break;
+        case FFBT_OP_UPLOAD:
+            if (record->flags & FFBT_REC_REPLY) {
+                length = snprintf(string, size, "%s %d id:%d", prefix, record->result, record->value);
+            } else {
+                ffbt_effect_unpack(&effect, &record->effect);
+                ffbt_format_effect_params(params, sizeof(params), &effect);
+                length = snprintf(string, size, "%s UPLOAD id:%d dir:%d length:%d delay:%d type:%s %s",
+                        prefix, effect.id, effect.direction,
+                        effect.replay.length, effect.replay.delay,
+                        ffbt_effect_type_name(&effect), params);
+            }
+            break;
+        case FFBT_OP_REMOVE:
+            if (record->flags & FFBT_REC_REPLY) {
+                length = snprintf(string, size, "%s %d", prefix, record->result);
+            } else {
+                length = snprintf(string, size, "%s REMOVE %d # Remove effect from memory.", prefix, record->value);
+            }
+            break;
+        case FFBT_OP_PLAY:
+            if (record->flags & FFBT_REC_REPLY) {
+                length = snprintf(string, size, "%s %d", prefix, record->result);
+            } else if (record->value) {
+                length = snprintf(string, size, "%s PLAY %u %d", prefix, record->aux, record->value);
+            } else {
+                length = snprintf(string, size, "%s STOP %u", prefix, record->aux);
+            }
+            break;
+        case FFBT_OP_GAIN:
+            if (record->flags & FFBT_REC_REPLY) {
+                length = snprintf(string, size, "%s %d", prefix, record->result);
+            } else {
+                length = snprintf(string, size, "%s GAIN %d", prefix, record->value);
+            }
+            break;
+        case FFBT_OP_AUTOCENTER:
+            if (record->flags & FFBT_REC_REPLY) {
+                length = snprintf(string, size, "%s %d", prefix, record->result);
+            } else {
+                length = snprintf(string, size, "%s AUTOCENTER %d", prefix, record->value);
+            }
+            break;
+        default:
+            snprintf(string, size, "# unknown record");
+            return;
+    }
+
+    if (record->tag < sizeof(tag_names) / sizeof(tag_names[0]) && tag_names[record->tag] != NULL &&
+            length >= 0 && (size_t)length < size) {
+        snprintf(string + length, size - length, " # %s", tag_names[record->tag]);
+    }
+}
+
+/*
+ * Parses a log line, returns 1 when it has a record.
+ */
+static int ffbt_parse_line(struct ffbt_trace *trace, char *line, struct ffbt_record *record)
+{
+    struct ff_effect effect;
+    char *next_token;
+    char *token;
+    char *note;
+    char *op;
+
+    memset(record, 0, sizeof(*record));
+
+    token = strtok_r(line, "\r\n", &next_token);
+    if (token == NULL || token[0] == '\0') {
+        return 0;
+    }
+    token = strtok_r(token, " ", &next_token);
+    if (token == NULL || token[0] == '\0') {
+        return 0;
+    }
+    record->time = strtoull(token, &note, 10) * 1000;
+    // Records from other devices than the first have their number after the time
+    if (note[0] == ':') {
+        record->dev = strtoul(note + 1, NULL, 10);
+    }
+
+    while (next_token[0] == ' ') {
+        next_token++;
+    }
+
+    if (next_token[0] == '#') {
+        if (next_token[1] != '>' && next_token[1] != '<') {
+            record->op = FFBT_OP_NOTE;
+            record->tag = FFBT_TAG_COMMENT;
+            note = next_token + 1;
+            if (note[0] == ' ') {
+                note++;
+            }
+            snprintf(trace->comment, sizeof(trace->comment), "%s", note);
+            return 1;
+        }
+        record->flags |= FFBT_REC_COMMENTED;
+        next_token++;
+    }
+
+    // Trailing comments tell which fix was applied
+    note = strstr(next_token, " #");
+    if (note != NULL) {
+        *note = '\0';
+        note += 2;
+        while (note[0] == ' ') {
+            note++;
+        }
+        for (size_t tag = 0; tag < sizeof(tag_names) / sizeof(tag_names[0]); tag++) {
+            if (tag_names[tag] != NULL && !strcmp(note, tag_names[tag])) {
+                record->tag = tag;
+            }
+        }
+    }
+
+    if (next_token[0] == '<') {
+        record->flags |= FFBT_REC_REPLY;
+        record->op = trace->last_op;
+        record->result = strtol(next_token + 1, NULL, 10);
+        if ((token = strstr(next_token, "id:")) != NULL) {
+            record->value = strtol(token + 3, NULL, 10);
+        } else if ((token = strstr(next_token, "effects:")) != NULL) {
+            record->value = strtol(token + 8, NULL, 10);
+        } else if (record->op == FFBT_OP_QUERY) {
+            for (size_t i = 0; i < sizeof(feature_names) / sizeof(feature_names[0]); i++) {
+                if (strstr(next_token, feature_names[i].name) != NULL) {
+                    setBit(feature_names[i].bit, record->features);
+                }
+            }
+        }
+        return 1;
+    }
+
+    if (next_token[0] != '>') {
+        return 0;
+    }
+
+    op = strtok_r(next_token + 1, " ", &next_token);
+    if (op == NULL) {
+        return 0;
+    }
+
+    if (!strcmp(op, "QUERY")) {
+        record->op = FFBT_OP_QUERY;
+    } else if (!strcmp(op, "SLOTS")) {
+        record->op = FFBT_OP_SLOTS;
+    } else if (!strcmp(op, "UPLOAD")) {
+        record->op = FFBT_OP_UPLOAD;
+        ffbt_parse_effect(&effect, next_token);
+        record->effect = ffbt_effect_pack(&effect);
+    } else if (!strcmp(op, "REMOVE")) {
+        record->op = FFBT_OP_REMOVE;
+        record->value = strtol(next_token, NULL, 0);
+    } else if (!strcmp(op, "PLAY")) {
+        record->op = FFBT_OP_PLAY;
+        record->aux = strtol(next_token, &next_token, 0);
+        record->value = strtol(next_token, NULL, 0);
+    } else if (!strcmp(op, "STOP")) {
+        record->op = FFBT_OP_PLAY;
+        record->aux = strtol(next_token, NULL, 0);
+    } else if (!strcmp(op, "GAIN")) {
+        record->op = FFBT_OP_GAIN;
+        record->value = strtol(next_token, NULL, 0);
+    } else if (!strcmp(op, "AUTOCENTER")) {
+        record->op = FFBT_OP_AUTOCENTER;
+        record->value = strtol(next_token, NULL, 0);
+    } else {
+        return 0;
+    }
+
+    trace->last_op = record->op;
+
+    return 1;
+}
+
+int ffbt_trace_open_read(struct ffbt_trace *trace, FILE *file)
+{
+    struct ffbt_trace_header header;
+    int c;
+
+    memset(trace, 0, sizeof(*trace));
+    trace->file = file;
+
+    c = getc(file);
+    if (c == EOF) {
+        return 0;
+    }
+    ungetc(c, file);
+
+    // Text logs start with a timestamp
+    if (c != FFBT_TRACE_MAGIC[0]) {
+        trace->format = FFBT_TRACE_TEXT;
+        return 0;
+    }
+
+    if (fread(&header, sizeof(header), 1, file) != 1 ||
+            memcmp(header.magic, FFBT_TRACE_MAGIC, sizeof(header.magic)) ||
+            header.version > FFBT_TRACE_VERSION) {
+        return -1;
+    }
+
+    trace->format = FFBT_TRACE_BINARY;
+    trace->t0 = header.epoch;
+    trace->epoch = header.epoch;
+    trace->padded = header.flags & FFBT_TRACE_PADDED;
+    memcpy(trace->info, header.info, sizeof(trace->info));
+    trace->info[sizeof(trace->info) - 1] = '\0';
+    trace->info_pending = trace->info[0] != '\0';
+
+    return 0;
+}
+
+static int ffbt_trace_read_binary(struct ffbt_trace *trace, struct ffbt_record *record)
+{
+    struct ffbt_trace_header header;
+    struct ffbt_trace_entry entry;
+    uint8_t payload[FFBT_TRACE_MAX_ENTRY_SIZE];
+    uint16_t *words;
+    uint32_t mask;
+    size_t size;
+    int id;
+
+    for (;;) {
+        if (fread(&entry.time, sizeof(entry.time), 1, trace->file) != 1) {
+            return 0;
+        }
+        // Unused space in padded traces is zeroed
+        if (trace->padded && entry.time == 0) {
+            continue;
+        }
+        // Traces can be concatenated, like the segments of a recording
+        if (!memcmp(&entry.time, FFBT_TRACE_MAGIC, sizeof(entry.time))) {
+            memcpy(&header, &entry.time, sizeof(entry.time));
+            if (fread((uint8_t*) &header + sizeof(entry.time), sizeof(header) - sizeof(entry.time), 1, trace->file) != 1 ||
+                    header.version > FFBT_TRACE_VERSION) {
+                return -1;
+            }
+            trace->t0 = header.epoch;
+            trace->epoch = header.epoch;
+            trace->padded = header.flags & FFBT_TRACE_PADDED;
+            continue;
+        }
+        if (fread((uint8_t*) &entry + sizeof(entry.time), sizeof(entry) - sizeof(entry.time), 1, trace->file) != 1) {
+            // Recordings can end with an incomplete entry
+            return 0;
+        }
+        break;
+    }
+
+    if (entry.payload_size > sizeof(payload) ||
+            fread(payload, 1, entry.payload_size, trace->file) != entry.payload_size) {
+        return -1;
+    }
+
+    memset(record, 0, sizeof(*record));
+    record->time = entry.time - trace->t0;
+    record->op = entry.op;
+    record->flags = entry.flags & ~FFBT_ENTRY_DELTA;
+    record->tag = entry.tag;
+    record->dev = entry.dev;
+    record->fd = entry.fd;
+    record->result = entry.result;
+    record->value = entry.value;
+    record->aux = entry.aux;
+
+    if (record->op == FFBT_OP_UPLOAD && !(record->flags & FFBT_REC_REPLY)) {
+        id = entry.value;
+        if (entry.flags & FFBT_ENTRY_DELTA) {
+            if (id < 0 || id >= FFBT_TRACE_DELTA_IDS || !trace->has_upload[id] ||
+                    entry.payload_size < sizeof(mask)) {
+                return -1;
+            }
+            record->effect = trace->uploads[id];
+            memcpy(&mask, payload, sizeof(mask));
+            words = (uint16_t*) &record->effect;
+            size = sizeof(mask);
+            for (size_t i = 0; i < FFBT_EFFECT_WORDS; i++) {
+                if (mask & (1 << i)) {
+                    if (size + sizeof(uint16_t) > entry.payload_size) {
+                        return -1;
+                    }
+                    memcpy(&words[i], payload + size, sizeof(uint16_t));
+                    size += sizeof(uint16_t);
+                }
+            }
+        } else {
+            if (entry.payload_size < sizeof(record->effect)) {
+                return -1;
+            }
+            memcpy(&record->effect, payload, sizeof(record->effect));
+        }
+        if (id >= 0 && id < FFBT_TRACE_DELTA_IDS) {
+            trace->uploads[id] = record->effect;
+            trace->has_upload[id] = 1;
+        }
+        record->value = 0;
+    } else if (record->op == FFBT_OP_QUERY && (record->flags & FFBT_REC_REPLY)) {
+        memcpy(record->features, payload, entry.payload_size < sizeof(record->features) ?
+                entry.payload_size : sizeof(record->features));
+    } else if (record->op == FFBT_OP_NOTE && record->tag == FFBT_TAG_COMMENT) {
+        memcpy(trace->comment, payload, entry.payload_size);
+        trace->comment[entry.payload_size < sizeof(trace->comment) ?
+            entry.payload_size : sizeof(trace->comment) - 1] = '\0';
+    }
+
+    return 1;
+}
+
+/*
+ * Takes the time origin from the comment at the start of the logs, for
+ * traces that don't have it in the header.
+ */
+static void ffbt_trace_read_epoch(struct ffbt_trace *trace, const struct ffbt_record *record)
+{
+    const char *epoch;
+
+    if (trace->epoch != 0 || record->time != 0 || record->op != FFBT_OP_NOTE ||
+            record->tag != FFBT_TAG_COMMENT) {
+        return;
+    }
+
+    epoch = strstr(trace->comment, FFBT_TRACE_EPOCH);
+    if (epoch != NULL) {
+        trace->epoch = strtoull(epoch + strlen(FFBT_TRACE_EPOCH), NULL, 10);
+    }
+}
+
+/*
+ * Reads the next record, returns 1 when there's one, 0 at the end of the
+ * trace and -1 on errors. Comments are stored in trace->comment. Record times
+ * are relative to trace->epoch, when it's known.
+ */
+int ffbt_trace_read(struct ffbt_trace *trace, struct ffbt_record *record)
+{
+    char line[1024];
+    int result;
+
+    if (trace->info_pending) {
+        trace->info_pending = 0;
+        memset(record, 0, sizeof(*record));
+        record->op = FFBT_OP_NOTE;
+        record->tag = FFBT_TAG_COMMENT;
+        snprintf(trace->comment, sizeof(trace->comment), "%s", trace->info);
+        return 1;
+    }
+
+    if (trace->format == FFBT_TRACE_BINARY) {
+        result = ffbt_trace_read_binary(trace, record);
+        if (result > 0) {
+            ffbt_trace_read_epoch(trace, record);
+        }
+        return result;
+    }
+
+    while (fgets(line, sizeof(line), trace->file)) {
+        if (ffbt_parse_line(trace, line, record)) {
+            ffbt_trace_read_epoch(trace, record);
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+void ffbt_trace_init_header(struct ffbt_trace_header *header, uint64_t epoch, const char *info)
+{
+    memset(header, 0, sizeof(*header));
+    memcpy(header->magic, FFBT_TRACE_MAGIC, sizeof(header->magic));
+    header->version = FFBT_TRACE_VERSION;
+    header->epoch = epoch;
+    if (info != NULL) {
+        snprintf(header->info, sizeof(header->info), "%s", info);
+    }
+}
+
+/*
+ * Starts writing a trace to the file. Record times are relative to epoch.
+ * The header is only written to empty files, so a log can be appended to.
+ */
+void ffbt_trace_open_write(struct ffbt_trace *trace, FILE *file, int format, uint64_t epoch, const char *info)
+{
+    struct ffbt_trace_header header;
+
+    memset(trace, 0, sizeof(*trace));
+    trace->file = file;
+    trace->format = format;
+    trace->t0 = epoch;
+
+    if (ftell(file) > 0) {
+        return;
+    }
+
+    if (format == FFBT_TRACE_BINARY) {
+        ffbt_trace_init_header(&header, epoch, info);
+        fwrite(&header, sizeof(header), 1, file);
+    } else if (info != NULL) {
+        fprintf(file, "%012lu # %s\n", 0UL, info);
+    }
+}
+
+/*
+ * Encodes a record as a binary trace entry and returns its size. Uploads are
+ * delta encoded against the last upload of the same id in the trace, pass a
+ * NULL trace to always store the full effect. The buffer needs room for
+ * FFBT_TRACE_MAX_ENTRY_SIZE bytes.
+ */
+size_t ffbt_trace_encode(struct ffbt_trace *trace, const struct ffbt_record *record, const char *comment, uint8_t *buffer)
+{
+    struct ffbt_trace_entry *entry = (struct ffbt_trace_entry*) buffer;
+    uint8_t *payload = buffer + sizeof(*entry);
+    const uint16_t *words;
+    const uint16_t *last_words;
+    uint32_t mask = 0;
+    size_t size = 0;
+    int id;
+
+    memset(entry, 0, sizeof(*entry));
+    entry->time = record->time;
+    entry->op = record->op;
+    entry->flags = record->flags;
+    entry->tag = record->tag;
+    entry->dev = record->dev;
+    entry->fd = record->fd;
+    entry->result = record->result;
+    entry->value = record->value;
+    entry->aux = record->aux;
+
+    if (record->op == FFBT_OP_UPLOAD && !(record->flags & FFBT_REC_REPLY)) {
+        id = record->effect.id;
+        entry->value = id;
+        if (trace != NULL && id >= 0 && id < FFBT_TRACE_DELTA_IDS && trace->has_upload[id]) {
+            words = (const uint16_t*) &record->effect;
+            last_words = (const uint16_t*) &trace->uploads[id];
+            size = sizeof(mask);
+            for (size_t i = 0; i < FFBT_EFFECT_WORDS; i++) {
+                if (words[i] != last_words[i]) {
+                    mask |= 1 << i;
+                    memcpy(payload + size, &words[i], sizeof(uint16_t));
+                    size += sizeof(uint16_t);
+                }
+            }
+            memcpy(payload, &mask, sizeof(mask));
+            entry->flags |= FFBT_ENTRY_DELTA;
+        } else {
+            memcpy(payload, &record->effect, sizeof(record->effect));
+            size = sizeof(record->effect);
+        }
+        if (trace != NULL && id >= 0 && id < FFBT_TRACE_DELTA_IDS) {
+            trace->uploads[id] = record->effect;
+            trace->has_upload[id] = 1;
+        }
+    } else if (record->op == FFBT_OP_QUERY && (record->flags & FFBT_REC_REPLY)) {
+        memcpy(payload, record->features, sizeof(record->features));
+        size = sizeof(record->features);
+    } else if (record->op == FFBT_OP_NOTE && record->tag == FFBT_TAG_COMMENT && comment != NULL) {
+        size = strnlen(comment, FFBT_TRACE_MAX_ENTRY_SIZE - sizeof(*entry) - 8);
+        memcpy(payload, comment, size);
+    }
+
+    entry->payload_size = size;
+
+    return sizeof(*entry) + size;
+}
+
+/*
+ * Pads an encoded entry to a multiple of 8 bytes for padded traces.
+ */
+size_t ffbt_trace_pad(uint8_t *buffer, size_t size)
+{
+    struct ffbt_trace_entry *entry = (struct ffbt_trace_entry*) buffer;
+    size_t padding = -size & 7;
+
+    memset(buffer + size, 0, padding);
+    entry->payload_size += padding;
+
+    return size + padding;
+}
+
+static int ffbt_trace_write_binary(struct ffbt_trace *trace, const struct ffbt_record *record, const char *comment)
+{
+    uint8_t buffer[FFBT_TRACE_MAX_ENTRY_SIZE];
+    size_t size;
+
+    size = ffbt_trace_encode(trace, record, comment, buffer);
+
+    if (fwrite(buffer, size, 1, trace->file) != 1) {
+        return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * Writes a record, the comment is only used for comment notes.
+ */
+int ffbt_trace_write(struct ffbt_trace *trace, const struct ffbt_record *record, const char *comment)
+{
+    char string[1024];
+    int result;
+
+    if (trace->format == FFBT_TRACE_BINARY) {
+        return ffbt_trace_write_binary(trace, record, comment);
+    }
+
+    ffbt_format_record(string, sizeof(string), record, comment);
+
+    if (record->dev != 0) {
+        result = fprintf(trace->file, "%012lu:%u %s\n", (unsigned long)((record->time - trace->t0) / 1000),
+                record->dev, string);
+    } else {
+        result = fprintf(trace->file, "%012lu %s\n", (unsigned long)((record->time - trace->t0) / 1000), string);
+    }
+    if (result < 0) {
+        return -1;
+    }
+
+    return 0;
+}
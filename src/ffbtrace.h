@@ -0,0 +1,166 @@
+/*
+ *
+ * ffbtrace.h
+ *
+ * FFB trace records and their text and binary log formats
+ *
+ * Copyright 2019 Bernat Arlandis <bernat@hotmail.com>
+ */
+
+/*
+ * This file is part of ffbtools.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef FFBTRACE_H
+#define FFBTRACE_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <linux/input.h>
+
+#define FFBT_TRACE_MAGIC "FFBTRACE"
+#define FFBT_TRACE_VERSION (1)
+
+/* Largest binary trace entry, with a comment */
+#define FFBT_TRACE_MAX_ENTRY_SIZE (1024)
+
+/* Effect ids that can be delta encoded in binary traces */
+#define FFBT_TRACE_DELTA_IDS (256)
+
+/*
+ * Logs start with a comment telling the process that wrote them and the
+ * absolute monotonic time of their time origin, in ns.
+ */
+#define FFBT_TRACE_PID "PID="
+#define FFBT_TRACE_EPOCH "EPOCH="
+
+enum ffbt_op {
+    FFBT_OP_NOTE = 0,
+    FFBT_OP_QUERY,
+    FFBT_OP_SLOTS,
+    FFBT_OP_UPLOAD,
+    FFBT_OP_REMOVE,
+    FFBT_OP_PLAY,
+    FFBT_OP_GAIN,
+    FFBT_OP_AUTOCENTER,
+};
+
+enum ffbt_tag {
+    FFBT_TAG_NONE = 0,
+    FFBT_TAG_DURATION_FIX,
+    FFBT_TAG_DIRECTION_FIX,
+    FFBT_TAG_FORCE_INVERSION,
+    FFBT_TAG_OFFSET_FIX,
+    FFBT_TAG_UPDATE_FIX,
+    FFBT_TAG_FEATURES_HACK,
+    FFBT_TAG_IGNORED,
+    FFBT_TAG_CANNOT_THROTTLE,
+    FFBT_TAG_DROPPED,
+    FFBT_TAG_COMMENT,
+    FFBT_TAG_SUPPRESSED,
+    FFBT_TAG_RENDERED,
+};
+
+enum ffbt_trace_format {
+    FFBT_TRACE_TEXT = 0,
+    FFBT_TRACE_BINARY,
+};
+
+/* The line is a reply from the device */
+#define FFBT_REC_REPLY (1 << 0)
+/* The line is commented out, it's not what was finally sent or returned */
+#define FFBT_REC_COMMENTED (1 << 1)
+
+/*
+ * Same contents as struct ff_effect but with the same layout in 32 and 64
+ * bits builds. The custom waveform data isn't kept.
+ */
+struct ffbt_effect {
+    uint16_t type;
+    int16_t id;
+    uint16_t direction;
+    uint16_t trigger_button;
+    uint16_t trigger_interval;
+    uint16_t replay_length;
+    uint16_t replay_delay;
+    uint16_t reserved;
+    uint8_t u[24];
+};
+
+/*
+ * One line of the log. The meaning of value and aux depends on the op:
+ * REMOVE has the effect id in value, PLAY has the count in value and the
+ * effect id in aux, GAIN and AUTOCENTER have the level in value. Replies to
+ * UPLOAD and SLOTS have the effect id and the number of effects in value.
+ */
+struct ffbt_record {
+    uint64_t time;
+    uint8_t op;
+    uint8_t flags;
+    uint8_t tag;
+    uint8_t dev;
+    int32_t fd;
+    int32_t result;
+    int32_t value;
+    int32_t aux;
+    uint32_t reserved;
+    union {
+        struct ffbt_effect effect;
+        uint8_t features[FF_CNT / 8];
+    };
+};
+
+/* Entries are aligned to 8 bytes and there can be zeroed space between them */
+#define FFBT_TRACE_PADDED (1 << 0)
+
+struct ffbt_trace_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t flags;
+    uint64_t epoch;
+    char info[232];
+};
+
+struct ffbt_trace {
+    FILE *file;
+    int format;
+    uint64_t t0;
+    uint64_t epoch;
+    int last_op;
+    int padded;
+    int info_pending;
+    char info[232];
+    char comment[1024];
+    uint8_t has_upload[FFBT_TRACE_DELTA_IDS];
+    struct ffbt_effect uploads[FFBT_TRACE_DELTA_IDS];
+};
+
+struct ffbt_effect ffbt_effect_pack(const struct ff_effect *effect);
+void ffbt_effect_unpack(struct ff_effect *effect, const struct ffbt_effect *packed);
+void ffbt_init_effect(struct ff_effect *effect);
+void ffbt_parse_effect(struct ff_effect *effect, char *params);
+
+void ffbt_format_record(char *string, size_t size, const struct ffbt_record *record, const char *comment);
+
+int ffbt_trace_open_read(struct ffbt_trace *trace, FILE *file);
+int ffbt_trace_read(struct ffbt_trace *trace, struct ffbt_record *record);
+void ffbt_trace_init_header(struct ffbt_trace_header *header, uint64_t epoch, const char *info);
+size_t ffbt_trace_encode(struct ffbt_trace *trace, const struct ffbt_record *record, const char *comment, uint8_t *buffer);
+size_t ffbt_trace_pad(uint8_t *buffer, size_t size);
+void ffbt_trace_open_write(struct ffbt_trace *trace, FILE *file, int format, uint64_t epoch, const char *info);
+int ffbt_trace_write(struct ffbt_trace *trace, const struct ffbt_record *record, const char *comment);
+
+#endif
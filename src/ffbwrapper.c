@@ -28,6 +28,7 @@
 #include <dlfcn.h>
 #include <pthread.h>
 #include <signal.h>
+#include <stdatomic.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -36,6 +37,14 @@
 #include <strings.h>
 #include <time.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <stdarg.h>
+#include <unistd.h>
+#include <sched.h>
+#include <linux/futex.h>
+#include <semaphore.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/sysmacros.h>
@@ -43,130 +52,2427 @@
 #include <linux/input.h>
 #undef ioctl
 
-#define FFBTOOLS_MAX_EFFECT_ID (63)
-#define FFBTOOLS_THROTTLE_BUFFER_SIZE (FFBTOOLS_MAX_EFFECT_ID + 1)
+#include "ffbstats.h"
+#include "ffbtrace.h"
+
+#define FFBTOOLS_MAX_DEVICES (8)
+#define FFBTOOLS_INITIAL_EFFECTS (16)
+#define FFBTOOLS_THROTTLE_QUEUE_SIZE (256)
+#define FFBTOOLS_MAX_CONDITIONS (16)
+#define FFBTOOLS_DEFAULT_RENDER_RATE (1000)
+
+/* Real-time signal printing the latency histograms, as an offset from SIGRTMIN */
+#define FFBTOOLS_DEFAULT_LATENCY_SIGNAL (4)
+
+/*
+ * Time constant of the filter smoothing the wheel speed and acceleration,
+ * and time without a new position after which the wheel is taken as still,
+ * in ns
+ */
+#define FFBTOOLS_RENDER_FILTER_TIME (10e6)
+#define FFBTOOLS_RENDER_STILL_TIME (50e6)
+
+/* Records per thread ring, must be a power of two */
+#define FFBTOOLS_LOG_RING_SIZE (1024)
+#define FFBTOOLS_LOG_DRAIN_INTERVAL (10e6)
+
+/* Size of the recording segments in MB */
+#define FFBTOOLS_DEFAULT_LOG_SEGMENT_SIZE (16)
+
+/* Upload cache slots per device, must be a power of two */
+#define FFBTOOLS_UPLOAD_CACHE_SLOTS (256)
+
+/* Fixes that can be applied to an upload */
+#define FFBTOOLS_MAX_UPLOAD_FIXES (4)
+
+/* File descriptors tracked in the device table, the rest are checked with fstat */
+#define FFBTOOLS_MAX_TRACKED_FDS (65536)
 
 #define ioctlRequestCode(request) (request & ((_IOC_DIRMASK << _IOC_DIRSHIFT) | (_IOC_TYPEMASK << _IOC_TYPESHIFT) | (_IOC_NRMASK << _IOC_NRSHIFT)))
 
-#define testBit(bit, array) ((array[bit/8] >> bit%8) & 1)
+/*
+ * Records are only built when the logger is enabled. Writing them to the log
+ * is left to ffbt_write_record(), which runs either right away or on the
+ * drain thread when the asynchronous logger is enabled.
+ */
+#define report(...) \
+    do { \
+        if (enable_logger) { \
+            struct ffbt_record report_record = { __VA_ARGS__ }; \
+            ffbt_output(&report_record); \
+        } \
+    } while (0)
+
+/*
+ * Single producer, single consumer ring. Every thread logging calls owns one
+ * and the drain thread is the only consumer, so pushing a record never
+ * blocks nor contends with other threads.
+ */
+struct ffbt_log_ring {
+    atomic_ulong head;
+    atomic_ulong tail;
+    atomic_ulong dropped;
+    unsigned long reported_dropped;
+    atomic_int orphaned;
+    struct ffbt_log_ring *next;
+    struct ffbt_record records[FFBTOOLS_LOG_RING_SIZE];
+};
+
+/*
+ * Preallocated log file mapped in memory. Threads reserve room for their
+ * entries moving the cursor, so recording is a memory copy and the entries
+ * are in the file even if the application crashes. Writers count themselves
+ * while they use the mapping, so a retired segment is only unmapped when
+ * they're gone.
+ */
+struct ffbt_log_segment {
+    uint8_t *map;
+    size_t size;
+    atomic_size_t cursor;
+    atomic_int writers;
+    int index;
+    struct ffbt_log_segment *next_retired;
+};
+
+/*
+ * Command waiting in the throttle queue, an upload or a play command.
+ */
+struct ffbt_throttle_command {
+    int op;
+    int fd;
+    int id;
+    int value;
+    struct ff_effect effect;
+};
+
+/*
+ * What's kept for each effect id of a device.
+ */
+struct ffbt_effect_state {
+    int id;
+    int sending;
+    uint16_t type;
+    int queue_last;
+    int queue_count;
+    uint64_t last_flush;
+    unsigned credits;
+};
+
+/*
+ * Last upload sent for an effect id, slots are picked by the id. Readers
+ * never block: they copy the slot and retry if the sequence changed
+ * meanwhile. Writers make the sequence odd while they change it.
+ */
+struct ffbt_cache_slot {
+    atomic_uint sequence;
+    int id;
+    int fd;
+    struct ffbt_effect effect;
+};
+
+/*
+ * Change made to effects before uploading them. Only the enabled ones are
+ * kept in the table, in the order they're applied. It returns false when it
+ * left the effect untouched.
+ */
+struct ffbt_upload_fix {
+    bool (*apply)(struct ff_effect *effect);
+    uint8_t tag;
+    uint16_t type;
+};
+
+/*
+ * Condition effect kept in user space to be rendered.
+ */
+struct ffbt_condition {
+    int id;
+    int fd;
+    bool playing;
+    int count;
+    uint64_t start;
+    struct ff_effect effect;
+};
 
-#define report(...) snprintf(report_string, sizeof(report_string), __VA_ARGS__); ffbt_output(report_string);
+/*
+ * State of one of the wrapped devices. Calls are matched to their device by
+ * the fd, and each device has its own log tag, effect ids, throttling queue
+ * and upload cache.
+ */
+struct ffbt_device {
+    unsigned int major;
+    unsigned int minor;
+    int index;
+    atomic_short last_effect_used;
+
+    /*
+     * Effect ids are mapped to their state with an open addressing index,
+     * and the states of the ids in use are kept together in a growing array.
+     */
+    pthread_spinlock_t effects_lock;
+    struct ffbt_effect_state *effects;
+    int effect_count;
+    int effect_capacity;
+    int *effect_order;
+    int *effect_index;
+    int effect_index_size;
+
+    bool throttling;
+    uint64_t throttle_interval;
+    int throttle_budget;
+    double throttle_tokens;
+    uint64_t throttle_tokens_time;
+    pthread_t throttle_thread;
+    atomic_int throttle_idle;
+    atomic_int throttle_queued;
+    pthread_mutex_t throttle_drain_lock;
+    struct ffbt_throttle_command throttle_queue[FFBTOOLS_THROTTLE_QUEUE_SIZE];
+    struct ffbt_throttle_command throttle_sending[FFBTOOLS_THROTTLE_QUEUE_SIZE];
+    int throttle_queue_length;
+
+    struct ffbt_cache_slot *upload_cache;
+    atomic_ulong upload_cache_hits;
+
+    /*
+     * Rendered condition effects, and the constant effect sending their
+     * force. The send lock keeps the fd open while the thread uses it.
+     */
+    bool rendering;
+    uint64_t render_interval;
+    pthread_t render_thread;
+    atomic_int render_idle;
+    pthread_spinlock_t render_lock;
+    pthread_mutex_t render_send_lock;
+    struct ffbt_condition conditions[FFBTOOLS_MAX_CONDITIONS];
+    int render_fd;
+    int render_id;
+    int16_t render_level;
+    unsigned long render_ticks;
+    uint64_t render_max_latency;
+
+    /*
+     * Histograms for each call and for the uploads of each effect type, and
+     * the counters published in shared memory. Either can be NULL.
+     */
+    struct ffbt_latency *latency;
+    struct ffbt_stats *stats;
+};
+
+#define ffbt_count(device, counter) \
+    do { \
+        if ((device)->stats != NULL) { \
+            atomic_fetch_add_explicit(&(device)->stats->counter, 1, memory_order_relaxed); \
+        } \
+    } while (0)
 
 static void ffbt_init() __attribute__((constructor));
 static void ffbt_close() __attribute__((destructor));
+static void ffbt_start();
+static inline struct ffbt_device *ffbt_get_device(int fd);
+static void ffbt_upload_cache_store(struct ffbt_device *device, int fd, const struct ff_effect *effect);
+static void ffbt_upload_cache_remove(struct ffbt_device *device, int id);
 
 static int (*_ioctl)(int fd, unsigned long request, char *argp);
-static unsigned int dev_major = 0;
-static unsigned int dev_minor = 0;
-static int enable_logger = 0;
-static int enable_update_fix = 0;
-static int enable_direction_fix = 0;
-static int enable_duration_fix = 0;
-static int enable_features_hack = 0;
-static int enable_force_inversion = 0;
-static int ignore_set_gain = 0;
-static int enable_offset_fix = 0;
-static int enable_throttling = 0;
+static struct ffbt_device devices[FFBTOOLS_MAX_DEVICES];
+static int device_count = 0;
+
+/*
+ * The options are set once by ffbt_setup(), and again in a forked child.
+ * They're atomic so threads always see them whole, reading them costs the
+ * same as a plain load.
+ */
+static atomic_int enable_logger = 0;
+static atomic_int enable_async_logger = 0;
+static atomic_int enable_update_fix = 0;
+static atomic_int enable_direction_fix = 0;
+static atomic_int enable_duration_fix = 0;
+static atomic_int enable_features_hack = 0;
+static atomic_int enable_force_inversion = 0;
+static atomic_int ignore_set_gain = 0;
+static atomic_int enable_offset_fix = 0;
+static atomic_int enable_upload_cache = 0;
+static atomic_int enable_condition_render = 0;
+static struct ffbt_upload_fix upload_fixes[FFBTOOLS_MAX_UPLOAD_FIXES];
+static atomic_int upload_fix_count = 0;
+static atomic_int enable_latency_stats = 0;
+static pthread_once_t setup_once = PTHREAD_ONCE_INIT;
+static atomic_int setup_done = 0;
+static pid_t setup_pid = 0;
+static atomic_int enable_stats = 0;
+static FILE *latency_file = NULL;
+static pthread_t latency_thread;
+static sem_t latency_signal;
+static atomic_int latency_stop = 0;
+static struct sigaction latency_old_action;
+static int latency_signal_number = 0;
 static FILE *log_file = NULL;
-static char report_string[1024];
-static short last_effect_used = 16;
-static bool effect_is_pending[FFBTOOLS_THROTTLE_BUFFER_SIZE] = {false};
-static int pending_fd[FFBTOOLS_THROTTLE_BUFFER_SIZE];
-static struct ff_effect pending_effects[FFBTOOLS_THROTTLE_BUFFER_SIZE];
-static bool play_cmd_is_pending[FFBTOOLS_THROTTLE_BUFFER_SIZE] = {false};
-static int pending_play_counts[FFBTOOLS_THROTTLE_BUFFER_SIZE] = {0};
-static pthread_spinlock_t pending_effects_lock;
-static timer_t throttle_timer_id;
-static struct sigevent throttle_sigev;
+static const char *log_filename = NULL;
+static uint64_t log_epoch = 0;
+static char log_info[232];
+static _Atomic(struct ffbt_log_segment *) log_segment = NULL;
+static struct ffbt_log_segment *retired_log_segments = NULL;
+static struct ffbt_log_segment *spare_log_segment = NULL;
+static pthread_t log_segment_thread;
+static atomic_int log_segment_idle = 0;
+static atomic_int log_segment_stop = 0;
+static pthread_mutex_t log_segment_lock = PTHREAD_MUTEX_INITIALIZER;
+static size_t log_segment_size = FFBTOOLS_DEFAULT_LOG_SEGMENT_SIZE << 20;
+static int log_max_segments = 0;
+static atomic_ulong log_segment_dropped = 0;
+static struct ffbt_trace log_trace;
+static pthread_mutex_t log_trace_lock = PTHREAD_MUTEX_INITIALIZER;
+static uint64_t log_last_time = 0;
+static _Atomic(struct ffbt_log_ring *) log_rings = NULL;
+static __thread struct ffbt_log_ring *thread_log_ring = NULL;
+static pthread_key_t log_ring_key;
+static pthread_t log_drain_thread;
+static atomic_int log_drain_stop = 0;
+static atomic_int throttle_stop = 0;
+static atomic_int render_stop = 0;
+static bool throttle_leading_edge = false;
+static unsigned throttle_weights[FF_EFFECT_MAX - FF_EFFECT_MIN + 1];
+static int upload_cache_tolerance = 0;
 static ssize_t (*_write)(int fd, const void *buf, size_t num) = NULL;
+static int (*_open)(const char *pathname, int flags, ...) = NULL;
+static int (*_open64)(const char *pathname, int flags, ...) = NULL;
+static int (*_openat)(int dirfd, const char *pathname, int flags, ...) = NULL;
+static int (*_openat64)(int dirfd, const char *pathname, int flags, ...) = NULL;
+static int (*__open_2_)(const char *pathname, int flags) = NULL;
+static int (*__open64_2_)(const char *pathname, int flags) = NULL;
+static int (*__openat_2_)(int dirfd, const char *pathname, int flags) = NULL;
+static int (*__openat64_2_)(int dirfd, const char *pathname, int flags) = NULL;
+static int (*_dup)(int oldfd) = NULL;
+static int (*_dup2)(int oldfd, int newfd) = NULL;
+static int (*_dup3)(int oldfd, int newfd, int flags) = NULL;
+static int (*_fcntl)(int fd, int cmd, ...) = NULL;
+static int (*_close)(int fd) = NULL;
+static int (*_close_range)(unsigned int first, unsigned int last, int flags) = NULL;
+
+/*
+ * Device of every fd, its index plus one, FFBT_FD_OTHER for other files, or
+ * 0 for fds that weren't seen being opened.
+ */
+#define FFBT_FD_OTHER (0xff)
+static _Atomic uint8_t fd_devices[FFBTOOLS_MAX_TRACKED_FDS];
 
-static void ffbt_output(char *message)
+static uint64_t ffbt_now()
 {
-    static struct timespec t0 = {0, 0};
     struct timespec now;
-    unsigned long reltime;
 
-    if (!enable_logger) {
-        return;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+/*
+ * The trace keeps state between records, the synchronous logger writes them
+ * one at a time.
+ */
+static void ffbt_write_record(const struct ffbt_record *record)
+{
+    if (!enable_async_logger) {
+        pthread_mutex_lock(&log_trace_lock);
     }
+    log_last_time = record->time;
+    ffbt_trace_write(&log_trace, record, NULL);
+    if (!enable_async_logger) {
+        pthread_mutex_unlock(&log_trace_lock);
+    }
+}
 
-    clock_gettime(CLOCK_MONOTONIC, &now);
+static void ffbt_log_ring_release(void *ring)
+{
+    atomic_store_explicit(&((struct ffbt_log_ring*) ring)->orphaned, 1, memory_order_release);
+}
+
+static struct ffbt_log_ring *ffbt_log_ring_acquire()
+{
+    struct ffbt_log_ring *ring;
+    int orphaned;
 
-    if (t0.tv_sec == 0 && t0.tv_nsec == 0) {
-        t0.tv_sec = now.tv_sec;
-        t0.tv_nsec = now.tv_nsec;
+    // Reuse the ring of a thread that has exited
+    for (ring = atomic_load(&log_rings); ring != NULL; ring = ring->next) {
+        orphaned = 1;
+        if (atomic_compare_exchange_strong(&ring->orphaned, &orphaned, 0)) {
+            break;
+        }
     }
 
-    reltime = (now.tv_sec - t0.tv_sec) * 1.0e6 + (now.tv_nsec - t0.tv_nsec) / 1.0e3;
+    if (ring == NULL) {
+        ring = calloc(1, sizeof(struct ffbt_log_ring));
+        if (ring == NULL) {
+            return NULL;
+        }
+        ring->next = atomic_load(&log_rings);
+        while (!atomic_compare_exchange_weak(&log_rings, &ring->next, ring));
+    }
 
-    fprintf(log_file, "%012lu %s\n", reltime, message);
-    fflush(log_file);
+    pthread_setspecific(log_ring_key, ring);
+    thread_log_ring = ring;
+
+    return ring;
 }
 
-static void ffbt_throttle_function(union sigval value)
+static void ffbt_log_ring_push(const struct ffbt_record *record)
 {
-    (void) value;
-    int fd;
-    struct input_event event;
-    struct ff_effect tmp_effect;
-
-    for (int id = 0; id < FFBTOOLS_THROTTLE_BUFFER_SIZE; id++) {
-        fd = pending_fd[id];
-        if (effect_is_pending[id]) {
-            pthread_spin_lock(&pending_effects_lock);
-            memcpy((char*) &tmp_effect, (char*) &pending_effects[id], sizeof(struct ff_effect));
-            effect_is_pending[id] = false;
-            pthread_spin_unlock(&pending_effects_lock);
-            _ioctl(fd, EVIOCSFF, (char*) &pending_effects[id]);
-        }
-        if (play_cmd_is_pending[id]) {
-            pthread_spin_lock(&pending_effects_lock);
-            event.type = EV_FF;
-            event.code = id;
-            event.value = pending_play_counts[id];
-            play_cmd_is_pending[id] = false;
-            pthread_spin_unlock(&pending_effects_lock);
-            _write(fd, &event, sizeof(event));
+    struct ffbt_log_ring *ring = thread_log_ring;
+    unsigned long head;
+
+    if (ring == NULL) {
+        ring = ffbt_log_ring_acquire();
+        if (ring == NULL) {
+            return;
         }
     }
+
+    head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+
+    if (head - atomic_load_explicit(&ring->tail, memory_order_acquire) >= FFBTOOLS_LOG_RING_SIZE) {
+        atomic_fetch_add_explicit(&ring->dropped, 1, memory_order_relaxed);
+        return;
+    }
+
+    ring->records[head & (FFBTOOLS_LOG_RING_SIZE - 1)] = *record;
+    atomic_store_explicit(&ring->head, head + 1, memory_order_release);
 }
 
-#define FFBTOOLS_DEFAULT_TIMER_INTERVAL (3e6)
+/*
+ * Writes all the records queued so far merging the rings by time, so the log
+ * keeps its order when several threads are logging.
+ */
+static void ffbt_log_drain()
+{
+    struct ffbt_log_ring *ring;
+    struct ffbt_log_ring *next_ring;
+    struct ffbt_record *record;
+    unsigned long tail;
+    unsigned long dropped;
+    int written = 0;
+
+    do {
+        next_ring = NULL;
+        record = NULL;
+        for (ring = atomic_load(&log_rings); ring != NULL; ring = ring->next) {
+            tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+            if (tail == atomic_load_explicit(&ring->head, memory_order_acquire)) {
+                continue;
+            }
+            if (record == NULL || ring->records[tail & (FFBTOOLS_LOG_RING_SIZE - 1)].time < record->time) {
+                next_ring = ring;
+                record = &ring->records[tail & (FFBTOOLS_LOG_RING_SIZE - 1)];
+            }
+        }
+        if (next_ring != NULL) {
+            ffbt_write_record(record);
+            tail = atomic_load_explicit(&next_ring->tail, memory_order_relaxed);
+            atomic_store_explicit(&next_ring->tail, tail + 1, memory_order_release);
+            written++;
+        }
+    } while (next_ring != NULL);
+
+    for (ring = atomic_load(&log_rings); ring != NULL; ring = ring->next) {
+        dropped = atomic_load_explicit(&ring->dropped, memory_order_relaxed);
+        if (dropped != ring->reported_dropped) {
+            struct ffbt_record note = {
+                .time = log_last_time,
+                .op = FFBT_OP_NOTE,
+                .tag = FFBT_TAG_DROPPED,
+                .value = dropped - ring->reported_dropped,
+            };
+            ffbt_write_record(&note);
+            ring->reported_dropped = dropped;
+            written++;
+        }
+    }
+
+    if (written) {
+        fflush(log_file);
+    }
+}
 
-static void ffbt_get_timer_interval(struct timespec *ret, const char *str_interval) {
-    // Use the default for invalid values
-    *ret = (struct timespec){
+static void *ffbt_log_drain_function(void *arg)
+{
+    (void) arg;
+    struct timespec interval = {
         .tv_sec = 0,
-        .tv_nsec = FFBTOOLS_DEFAULT_TIMER_INTERVAL
+        .tv_nsec = FFBTOOLS_LOG_DRAIN_INTERVAL
     };
-    if (strlen(str_interval) <= 0) {
+
+    while (!atomic_load(&log_drain_stop)) {
+        nanosleep(&interval, NULL);
+        ffbt_log_drain();
+    }
+
+    return NULL;
+}
+
+static void ffbt_futex_wait(atomic_int *address, int value)
+{
+    syscall(SYS_futex, address, FUTEX_WAIT_PRIVATE, value, NULL, NULL, 0);
+}
+
+static void ffbt_futex_wake(atomic_int *address)
+{
+    syscall(SYS_futex, address, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+}
+
+static void ffbt_log_segment_name(char *name, size_t size, int index)
+{
+    snprintf(name, size, "%s.%d.%04d", log_filename, getpid(), index);
+}
+
+static struct ffbt_log_segment *ffbt_log_segment_open(int index)
+{
+    struct ffbt_log_segment *segment;
+    struct ffbt_trace_header header;
+    char name[4096];
+    int fd;
+
+    ffbt_log_segment_name(name, sizeof(name), index);
+
+    fd = open(name, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        return NULL;
+    }
+
+    if (fallocate(fd, 0, 0, log_segment_size) != 0 && ftruncate(fd, log_segment_size) != 0) {
+        close(fd);
+        return NULL;
+    }
+
+    segment = malloc(sizeof(*segment));
+    if (segment == NULL) {
+        close(fd);
+        return NULL;
+    }
+
+    segment->map = mmap(NULL, log_segment_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (segment->map == MAP_FAILED) {
+        free(segment);
+        return NULL;
+    }
+
+    segment->size = log_segment_size;
+    segment->index = index;
+    ffbt_trace_init_header(&header, log_epoch, log_info);
+    header.flags |= FFBT_TRACE_PADDED;
+    memcpy(segment->map, &header, sizeof(header));
+    atomic_init(&segment->cursor, sizeof(header));
+    atomic_init(&segment->writers, 0);
+    segment->next_retired = NULL;
+
+    // Keep the total size under the limit removing the oldest segments
+    if (log_max_segments > 0 && index >= log_max_segments) {
+        ffbt_log_segment_name(name, sizeof(name), index - log_max_segments);
+        unlink(name);
+    }
+
+    return segment;
+}
+
+/*
+ * Unmaps the retired segments that no thread is writing to. Threads that
+ * took a segment before it was retired are counted in its writers, and the
+ * ones that come later see it's not the current segment anymore and leave
+ * it without touching the mapping. The structures are never freed, a late
+ * thread can still be looking at them. Must be called with the segment lock.
+ */
+static void ffbt_log_segment_reclaim()
+{
+    struct ffbt_log_segment *segment;
+
+    for (segment = retired_log_segments; segment != NULL; segment = segment->next_retired) {
+        if (segment->map != NULL && atomic_load(&segment->writers) == 0) {
+            munmap(segment->map, segment->size);
+            segment->map = NULL;
+        }
+    }
+}
+
+/*
+ * Replaces a full segment with the one prepared by the segment thread, or
+ * opens it here if the thread is behind. Threads still writing to the full
+ * segment keep it mapped until the segment thread finds them gone.
+ */
+static void ffbt_log_segment_rotate(struct ffbt_log_segment *full)
+{
+    struct ffbt_log_segment *segment;
+
+    pthread_mutex_lock(&log_segment_lock);
+
+    if (atomic_load(&log_segment) == full) {
+        if (spare_log_segment != NULL) {
+            segment = spare_log_segment;
+            spare_log_segment = NULL;
+        } else {
+            segment = ffbt_log_segment_open(full->index + 1);
+            if (segment == NULL) {
+                fprintf(stderr, "Cannot create log segment: %s\n", strerror(errno));
+            }
+        }
+        atomic_store(&log_segment, segment);
+        full->next_retired = retired_log_segments;
+        retired_log_segments = full;
+    }
+
+    pthread_mutex_unlock(&log_segment_lock);
+
+    if (atomic_exchange(&log_segment_idle, 0)) {
+        ffbt_futex_wake(&log_segment_idle);
+    }
+}
+
+/*
+ * Opens the next segment ahead of time and unmaps the retired ones, so
+ * rotating doesn't make system calls in the threads being logged.
+ */
+static void *ffbt_log_segment_function(void *arg)
+{
+    struct ffbt_log_segment *segment;
+
+    (void) arg;
+
+    for (;;) {
+        atomic_store(&log_segment_idle, 1);
+        if (atomic_load(&log_segment_stop)) {
+            break;
+        }
+
+        pthread_mutex_lock(&log_segment_lock);
+        ffbt_log_segment_reclaim();
+        segment = atomic_load(&log_segment);
+        if (spare_log_segment == NULL && segment != NULL) {
+            spare_log_segment = ffbt_log_segment_open(segment->index + 1);
+        }
+        pthread_mutex_unlock(&log_segment_lock);
+
+        ffbt_futex_wait(&log_segment_idle, 1);
+    }
+
+    return NULL;
+}
+
+static void ffbt_log_segment_write(const struct ffbt_record *record, const char *comment)
+{
+    struct ffbt_log_segment *segment;
+    uint8_t buffer[FFBT_TRACE_MAX_ENTRY_SIZE];
+    size_t offset;
+    size_t size;
+
+    // Several threads write at once, so uploads can't be delta encoded
+    size = ffbt_trace_pad(buffer, ffbt_trace_encode(NULL, record, comment, buffer));
+
+    while ((segment = atomic_load(&log_segment)) != NULL) {
+        atomic_fetch_add(&segment->writers, 1);
+        // It could have been retired before being counted
+        if (atomic_load(&log_segment) != segment) {
+            atomic_fetch_sub(&segment->writers, 1);
+            continue;
+        }
+        offset = atomic_fetch_add_explicit(&segment->cursor, size, memory_order_relaxed);
+        if (offset + size <= segment->size) {
+            memcpy(segment->map + offset, buffer, size);
+            atomic_fetch_sub_explicit(&segment->writers, 1, memory_order_release);
+            return;
+        }
+        atomic_fetch_sub_explicit(&segment->writers, 1, memory_order_release);
+        ffbt_log_segment_rotate(segment);
+    }
+
+    atomic_fetch_add_explicit(&log_segment_dropped, 1, memory_order_relaxed);
+}
+
+/*
+ * Retires the last segment like a rotation does and trims its unused space
+ * once no thread is writing to it. Records logged after this are dropped.
+ */
+static void ffbt_log_segment_close()
+{
+    struct ffbt_log_segment *segment;
+    char name[4096];
+    size_t cursor;
+
+    atomic_store(&log_segment_stop, 1);
+    atomic_store(&log_segment_idle, 0);
+    ffbt_futex_wake(&log_segment_idle);
+    pthread_join(log_segment_thread, NULL);
+
+    pthread_mutex_lock(&log_segment_lock);
+    segment = atomic_exchange(&log_segment, NULL);
+    if (spare_log_segment != NULL) {
+        ffbt_log_segment_name(name, sizeof(name), spare_log_segment->index);
+        unlink(name);
+    }
+    pthread_mutex_unlock(&log_segment_lock);
+
+    if (segment == NULL) {
         return;
     }
-    int param = atol(str_interval);
-    if (param < 1) {
+
+    while (atomic_load(&segment->writers) > 0) {
+        sched_yield();
+    }
+
+    cursor = atomic_load(&segment->cursor);
+    if (cursor < segment->size) {
+        ffbt_log_segment_name(name, sizeof(name), segment->index);
+        truncate(name, cursor);
+    }
+
+    if (atomic_load(&log_segment_dropped) > 0) {
+        fprintf(stderr, "Log segments missed %lu records.\n", atomic_load(&log_segment_dropped));
+    }
+}
+
+static void ffbt_output(struct ffbt_record *record)
+{
+    record->time = ffbt_now();
+
+    if (log_filename != NULL) {
+        ffbt_log_segment_write(record, NULL);
         return;
     }
-    ret->tv_nsec = param * 1e6;
+
+    if (enable_async_logger) {
+        ffbt_log_ring_push(record);
+        return;
+    }
+
+    ffbt_write_record(record);
+    fflush(log_file);
 }
 
-static void ffbt_init()
+/*
+ * Tells which process wrote the log and the time origin shared by the logs of
+ * all the processes, so they can be merged with ffbmerge.
+ */
+static void ffbt_log_origin()
 {
-    _ioctl = dlsym(RTLD_NEXT, "ioctl");
-    _write = dlsym(RTLD_NEXT, "write");
+    char comment[64];
+    struct ffbt_record record = {
+        .time = log_epoch,
+        .op = FFBT_OP_NOTE,
+        .tag = FFBT_TAG_COMMENT,
+    };
+
+    snprintf(comment, sizeof(comment), FFBT_TRACE_PID "%d, " FFBT_TRACE_EPOCH "%llu",
+            getpid(), (unsigned long long) log_epoch);
+
+    if (log_filename != NULL) {
+        ffbt_log_segment_write(&record, comment);
+    } else {
+        ffbt_trace_write(&log_trace, &record, comment);
+        fflush(log_file);
+    }
+}
 
-    const char *str_dev_major = getenv("FFBTOOLS_DEV_MAJOR");
-    const char *str_dev_minor = getenv("FFBTOOLS_DEV_MINOR");
+static void ffbt_latency_add(struct ffbt_latency *latency, uint64_t value)
+{
+    uint64_t max = atomic_load_explicit(&latency->max, memory_order_relaxed);
+
+    atomic_fetch_add_explicit(&latency->buckets[ffbt_latency_bucket(value)], 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&latency->count, 1, memory_order_relaxed);
+    while (value > max && !atomic_compare_exchange_weak_explicit(&latency->max, &max, value,
+                memory_order_relaxed, memory_order_relaxed)) {
+    }
+}
+
+/*
+ * Forwards an ioctl to the driver timing effect uploads and removals.
+ */
+static int ffbt_device_ioctl(struct ffbt_device *device, int fd, unsigned long request, char *argp)
+{
+    uint64_t start;
+    uint64_t time;
+    int result;
+
+    if (device->latency == NULL) {
+        return _ioctl(fd, request, argp);
+    }
+
+    start = ffbt_now();
+    result = _ioctl(fd, request, argp);
+    time = ffbt_now() - start;
+    if (result < 0) {
+        ffbt_count(device, errors);
+    }
+
+    switch (ioctlRequestCode(request)) {
+        case ioctlRequestCode(EVIOCSFF): {
+            uint16_t type = ((struct ff_effect*) argp)->type;
+
+            ffbt_latency_add(&device->latency[FFBT_CALL_UPLOAD], time);
+            if (type >= FF_EFFECT_MIN && type <= FF_EFFECT_MAX) {
+                ffbt_latency_add(&device->latency[FFBT_CALLS + type - FF_EFFECT_MIN], time);
+            }
+            break;
+        }
+        case ioctlRequestCode(EVIOCRMFF):
+            ffbt_latency_add(&device->latency[FFBT_CALL_REMOVE], time);
+            break;
+    }
+
+    return result;
+}
+
+/*
+ * Forwards a FF event to the driver timing it.
+ */
+static ssize_t ffbt_device_write(struct ffbt_device *device, int fd, const struct input_event *event, size_t num)
+{
+    uint64_t start;
+    ssize_t result;
+    int call;
+
+    if (device->latency == NULL) {
+        return _write(fd, event, num);
+    }
 
-    if (str_dev_major != NULL && str_dev_minor != NULL) {
-        dev_major = strtol(str_dev_major, NULL, 0);
-        dev_minor = strtol(str_dev_minor, NULL, 0);
+    start = ffbt_now();
+    result = _write(fd, event, num);
+    if (result < 0) {
+        ffbt_count(device, errors);
     }
 
+    if (event->code == FF_GAIN) {
+        call = FFBT_CALL_GAIN;
+    } else if (event->code == FF_AUTOCENTER) {
+        call = FFBT_CALL_AUTOCENTER;
+    } else {
+        call = event->value > 0 ? FFBT_CALL_PLAY : FFBT_CALL_STOP;
+    }
+    ffbt_latency_add(&device->latency[call], ffbt_now() - start);
+
+    return result;
+}
+
+/*
+ * Prints the percentiles of the histograms that have values. Buckets are
+ * copied first since other threads keep adding to them.
+ */
+static void ffbt_latency_print(struct ffbt_device *device)
+{
+    static const char *names[FFBT_LATENCY_HISTOGRAMS] = {
+        [FFBT_CALL_UPLOAD] = "upload",
+        [FFBT_CALL_PLAY] = "play",
+        [FFBT_CALL_STOP] = "stop",
+        [FFBT_CALL_REMOVE] = "remove",
+        [FFBT_CALL_GAIN] = "gain",
+        [FFBT_CALL_AUTOCENTER] = "autocenter",
+        [FFBT_CALLS + FF_RUMBLE - FF_EFFECT_MIN] = "  rumble",
+        [FFBT_CALLS + FF_PERIODIC - FF_EFFECT_MIN] = "  periodic",
+        [FFBT_CALLS + FF_CONSTANT - FF_EFFECT_MIN] = "  constant",
+        [FFBT_CALLS + FF_SPRING - FF_EFFECT_MIN] = "  spring",
+        [FFBT_CALLS + FF_FRICTION - FF_EFFECT_MIN] = "  friction",
+        [FFBT_CALLS + FF_DAMPER - FF_EFFECT_MIN] = "  damper",
+        [FFBT_CALLS + FF_INERTIA - FF_EFFECT_MIN] = "  inertia",
+        [FFBT_CALLS + FF_RAMP - FF_EFFECT_MIN] = "  ramp",
+    };
+    static const double percentiles[] = {0.5, 0.99, 0.999};
+    uint64_t buckets[FFBT_LATENCY_BUCKETS];
+    double values[3];
+    uint64_t count;
+    uint64_t max;
+    uint64_t value;
+    int bucket;
+
+    fprintf(latency_file, "ffbwrapper: device %d call latency (us)\n", device->index);
+    fprintf(latency_file, "  %-12s %10s %10s %10s %10s %10s\n", "call", "count", "p50", "p99", "p99.9", "max");
+
+    for (int i = 0; i < FFBT_LATENCY_HISTOGRAMS; i++) {
+        struct ffbt_latency *latency = &device->latency[i];
+
+        count = 0;
+        for (bucket = 0; bucket < FFBT_LATENCY_BUCKETS; bucket++) {
+            buckets[bucket] = atomic_load_explicit(&latency->buckets[bucket], memory_order_relaxed);
+            count += buckets[bucket];
+        }
+        if (count == 0) {
+            continue;
+        }
+
+        max = atomic_load(&latency->max);
+        for (int j = 0; j < 3; j++) {
+            value = ffbt_latency_percentile(buckets, count, percentiles[j]);
+            values[j] = (value < max ? value : max) / 1e3;
+        }
+
+        fprintf(latency_file, "  %-12s %10llu %10.1f %10.1f %10.1f %10.1f\n", names[i], (unsigned long long) count,
+                values[0], values[1], values[2], max / 1e3);
+    }
+
+    fflush(latency_file);
+}
+
+static void ffbt_latency_signal_handler(int signal, siginfo_t *info, void *context)
+{
+    sem_post(&latency_signal);
+
+    if (latency_old_action.sa_flags & SA_SIGINFO) {
+        latency_old_action.sa_sigaction(signal, info, context);
+    } else if (latency_old_action.sa_handler != SIG_DFL && latency_old_action.sa_handler != SIG_IGN) {
+        latency_old_action.sa_handler(signal);
+    }
+}
+
+/*
+ * Creates the shared memory segment where the counters of a device are
+ * published for ffbtop.
+ */
+static struct ffbt_stats *ffbt_stats_open(struct ffbt_device *device)
+{
+    struct ffbt_stats *stats;
+    const char *device_name = getenv("FFBTOOLS_DEVICE_NAME");
+    char name[64];
+    int fd;
+
+    snprintf(name, sizeof(name), FFBT_STATS_NAME, getpid(), device->index);
+    fd = shm_open(name, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        return NULL;
+    }
+
+    if (ftruncate(fd, sizeof(*stats)) != 0) {
+        _close(fd);
+        shm_unlink(name);
+        return NULL;
+    }
+
+    stats = mmap(NULL, sizeof(*stats), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    _close(fd);
+    if (stats == MAP_FAILED) {
+        shm_unlink(name);
+        return NULL;
+    }
+
+    stats->version = FFBT_STATS_VERSION;
+    stats->pid = getpid();
+    stats->index = device->index;
+    stats->major = device->major;
+    stats->minor = device->minor;
+    stats->start_time = ffbt_now();
+    snprintf(stats->name, sizeof(stats->name), "%s", device_name != NULL ? device_name : "");
+    memcpy(stats->magic, FFBT_STATS_MAGIC, sizeof(stats->magic));
+
+    return stats;
+}
+
+/*
+ * Prints the histograms when the latency signal is received. Printing isn't
+ * safe from a signal handler so it's done here.
+ */
+static void *ffbt_latency_function(void *arg)
+{
+    (void) arg;
+
+    while (true) {
+        if (sem_wait(&latency_signal) != 0) {
+            continue;
+        }
+        if (atomic_load(&latency_stop)) {
+            break;
+        }
+        for (int i = 0; i < device_count; i++) {
+            ffbt_latency_print(&devices[i]);
+        }
+    }
+
+    return NULL;
+}
+
+static unsigned ffbt_effect_hash(int id)
+{
+    return (unsigned) id * 2654435761u;
+}
+
+/*
+ * Finds the bucket of an effect id in the index of the device, or the empty
+ * bucket where it would go. Collisions are solved probing the next buckets.
+ */
+static unsigned ffbt_effect_bucket(struct ffbt_device *device, int id)
+{
+    unsigned mask = device->effect_index_size - 1;
+    unsigned bucket = ffbt_effect_hash(id) & mask;
+
+    while (device->effect_index[bucket] != 0 &&
+            device->effects[device->effect_index[bucket] - 1].id != id) {
+        bucket = (bucket + 1) & mask;
+    }
+
+    return bucket;
+}
+
+/*
+ * Returns the state of an effect id, or NULL when it's not in the table.
+ * Must be called with the effects lock of the device held, like the rest of
+ * the effect table functions.
+ */
+static struct ffbt_effect_state *ffbt_find_effect(struct ffbt_device *device, int id)
+{
+    unsigned bucket;
+
+    if (device->effect_count == 0) {
+        return NULL;
+    }
+
+    bucket = ffbt_effect_bucket(device, id);
+    if (device->effect_index[bucket] == 0) {
+        return NULL;
+    }
+
+    return &device->effects[device->effect_index[bucket] - 1];
+}
+
+static bool ffbt_resize_effect_index(struct ffbt_device *device, int size)
+{
+    int *index = calloc(size, sizeof(*index));
+
+    if (index == NULL) {
+        return false;
+    }
+
+    free(device->effect_index);
+    device->effect_index = index;
+    device->effect_index_size = size;
+
+    for (int i = 0; i < device->effect_count; i++) {
+        index[ffbt_effect_bucket(device, device->effects[i].id)] = i + 1;
+    }
+
+    return true;
+}
+
+/*
+ * Returns the state of an effect id, adding it to the table when it's new.
+ * The table grows as needed, so it only returns NULL when out of memory.
+ */
+static struct ffbt_effect_state *ffbt_get_effect(struct ffbt_device *device, int id)
+{
+    struct ffbt_effect_state *effect = ffbt_find_effect(device, id);
+    int capacity;
+
+    if (effect != NULL) {
+        return effect;
+    }
+
+    if (device->effect_count == device->effect_capacity) {
+        capacity = device->effect_capacity > 0 ? device->effect_capacity * 2 : FFBTOOLS_INITIAL_EFFECTS;
+
+        effect = realloc(device->effects, capacity * sizeof(*device->effects));
+        if (effect == NULL) {
+            return NULL;
+        }
+        device->effects = effect;
+
+        int *order = realloc(device->effect_order, capacity * sizeof(*device->effect_order));
+        if (order == NULL) {
+            return NULL;
+        }
+        device->effect_order = order;
+        device->effect_capacity = capacity;
+    }
+
+    // Keep the index at most half full
+    if (2 * (device->effect_count + 1) > device->effect_index_size &&
+            !ffbt_resize_effect_index(device, device->effect_index_size > 0 ?
+                device->effect_index_size * 2 : 2 * FFBTOOLS_INITIAL_EFFECTS)) {
+        return NULL;
+    }
+
+    effect = &device->effects[device->effect_count];
+    memset(effect, 0, sizeof(*effect));
+    effect->id = id;
+    effect->queue_last = -1;
+    device->effect_index[ffbt_effect_bucket(device, id)] = ++device->effect_count;
+
+    return effect;
+}
+
+/*
+ * Takes an effect id out of the table. The last state takes its place, so
+ * the states of the ids in use stay together.
+ */
+static void ffbt_remove_effect(struct ffbt_device *device, int id)
+{
+    unsigned mask = device->effect_index_size - 1;
+    unsigned bucket;
+    unsigned next;
+    unsigned home;
+    int position;
+    int last;
+
+    if (ffbt_find_effect(device, id) == NULL) {
+        return;
+    }
+
+    bucket = ffbt_effect_bucket(device, id);
+    position = device->effect_index[bucket] - 1;
+
+    // Move back the ids that were probed past this bucket
+    next = bucket;
+    while (1) {
+        next = (next + 1) & mask;
+        if (device->effect_index[next] == 0) {
+            break;
+        }
+        home = ffbt_effect_hash(device->effects[device->effect_index[next] - 1].id) & mask;
+        if (((next - home) & mask) >= ((next - bucket) & mask)) {
+            device->effect_index[bucket] = device->effect_index[next];
+            bucket = next;
+        }
+    }
+    device->effect_index[bucket] = 0;
+
+    last = --device->effect_count;
+    if (position != last) {
+        device->effects[position] = device->effects[last];
+        device->effect_index[ffbt_effect_bucket(device, device->effects[position].id)] = position + 1;
+    }
+}
+
+/*
+ * Publishes the length of the throttle queue, called with the effects lock.
+ */
+static void ffbt_throttle_set_queued(struct ffbt_device *device, int length)
+{
+    atomic_store(&device->throttle_queued, length);
+    if (device->stats != NULL) {
+        atomic_store_explicit(&device->stats->queue_depth, length, memory_order_relaxed);
+        if ((uint64_t)length > atomic_load_explicit(&device->stats->queue_depth_max, memory_order_relaxed)) {
+            atomic_store_explicit(&device->stats->queue_depth_max, length, memory_order_relaxed);
+        }
+    }
+}
+
+/*
+ * Wakes the throttle thread if it's idle.
+ */
+static void ffbt_throttle_wake(struct ffbt_device *device)
+{
+    if (atomic_load(&device->throttle_idle) && atomic_exchange(&device->throttle_idle, 0)) {
+        ffbt_futex_wake(&device->throttle_idle);
+    }
+}
+
+/*
+ * Takes up to some reports from the device budget, refilling it first with
+ * what was earned since the last time at the budget rate, and returns how
+ * many were taken. The bucket holds the reports of one interval, but at
+ * least an upload and a play command. Must be called with the effects lock
+ * of the device held.
+ *
+ * There's a single bucket per device rather than one per effect id: the
+ * device queue is what fills up, so ids share it and the weighted credits
+ * in ffbt_throttle_select decide which ones get it first.
+ */
+static int ffbt_throttle_spend(struct ffbt_device *device, uint64_t now, int reports)
+{
+    double capacity;
+    int taken;
+
+    if (device->throttle_budget <= 0) {
+        return reports;
+    }
+
+    capacity = (double) device->throttle_budget * device->throttle_interval / 1e9;
+    if (capacity < 2) {
+        capacity = 2;
+    }
+
+    if (now > device->throttle_tokens_time) {
+        device->throttle_tokens += (double) device->throttle_budget * (now - device->throttle_tokens_time) / 1e9;
+        device->throttle_tokens_time = now;
+    }
+    if (device->throttle_tokens > capacity) {
+        device->throttle_tokens = capacity;
+    }
+
+    taken = device->throttle_tokens < reports ? (int) device->throttle_tokens : reports;
+    device->throttle_tokens -= taken;
+
+    return taken;
+}
+
+static unsigned ffbt_throttle_weight(const struct ffbt_effect_state *effect)
+{
+    if (effect->type < FF_EFFECT_MIN || effect->type > FF_EFFECT_MAX) {
+        return 1;
+    }
+
+    return throttle_weights[effect->type - FF_EFFECT_MIN];
+}
+
+/*
+ * In leading edge mode, decides if a command for this id can be sent right
+ * away, that is when nothing is queued for it, the id wasn't sent within the
+ * last interval and the device budget allows it. Uploads pass their effect
+ * type.
+ */
+static bool ffbt_throttle_pass(struct ffbt_device *device, int id, uint16_t type)
+{
+    struct ffbt_effect_state *effect;
+    bool pass = true;
+    uint64_t now = ffbt_now();
+
+    pthread_spin_lock(&device->effects_lock);
+    effect = ffbt_get_effect(device, id);
+    if (effect != NULL) {
+        if (type != 0) {
+            effect->type = type;
+        }
+        if (effect->queue_last < 0 &&
+                now >= effect->last_flush + device->throttle_interval &&
+                ffbt_throttle_spend(device, now, 1) == 1) {
+            effect->last_flush = now;
+        } else {
+            pass = false;
+        }
+    }
+    pthread_spin_unlock(&device->effects_lock);
+
+    return pass;
+}
+
+/*
+ * Chooses the ids whose queued commands are sent in this pass. Must be
+ * called with the effects lock held.
+ *
+ * With a device budget, every waiting id earns credits by the weight of its
+ * effect type on each pass and ids are chosen by most credits first, so an
+ * effect updated all the time can't starve the others. Each command takes
+ * one report from the budget, an id with more commands queued than the
+ * budget allows sends the oldest ones and keeps the rest. Sending an id
+ * spends all its credits. Forced passes send everything.
+ */
+static void ffbt_throttle_select(struct ffbt_device *device, uint64_t now, bool forced)
+{
+    struct ffbt_effect_state *effects = device->effects;
+    int *candidates = device->effect_order;
+    int count = 0;
+    int candidate;
+
+    for (int i = 0; i < device->effect_count; i++) {
+        if (effects[i].queue_last >= 0) {
+            candidates[count++] = i;
+        }
+    }
+
+    if (!forced && device->throttle_budget > 0) {
+        for (int i = 0; i < count; i++) {
+            effects[candidates[i]].credits += ffbt_throttle_weight(&effects[candidates[i]]);
+        }
+
+        for (int i = 1; i < count; i++) {
+            candidate = candidates[i];
+            int j = i;
+            for (; j > 0 && effects[candidates[j - 1]].credits < effects[candidate].credits; j--) {
+                candidates[j] = candidates[j - 1];
+            }
+            candidates[j] = candidate;
+        }
+    }
+
+    for (int i = 0; i < count; i++) {
+        struct ffbt_effect_state *effect = &effects[candidates[i]];
+
+        if (!forced && throttle_leading_edge && now < effect->last_flush + device->throttle_interval) {
+            // Sent on the leading edge, keep it for the next pass
+            continue;
+        }
+        effect->sending = forced ? effect->queue_count : ffbt_throttle_spend(device, now, effect->queue_count);
+    }
+}
+
+/*
+ * Sends the commands chosen in the order they were queued. The rest stay
+ * queued in the same order. Forced passes send
+ * everything, ignoring the leading edge and the budget.
+ */
+static void ffbt_throttle_drain(struct ffbt_device *device, uint64_t now, bool forced)
+{
+    struct ffbt_throttle_command *sending = device->throttle_sending;
+    struct ffbt_effect_state *effect;
+    struct input_event event;
+    int count = 0;
+    int kept = 0;
+
+    pthread_mutex_lock(&device->throttle_drain_lock);
+    pthread_spin_lock(&device->effects_lock);
+
+    ffbt_throttle_select(device, now, forced);
+
+    for (int i = 0; i < device->throttle_queue_length; i++) {
+        effect = ffbt_find_effect(device, device->throttle_queue[i].id);
+        if (effect->sending > 0) {
+            sending[count++] = device->throttle_queue[i];
+            effect->sending--;
+            effect->queue_count--;
+            effect->last_flush = now;
+            effect->credits = 0;
+        } else {
+            effect->queue_last = kept;
+            device->throttle_queue[kept++] = device->throttle_queue[i];
+        }
+    }
+    device->throttle_queue_length = kept;
+    ffbt_throttle_set_queued(device, kept);
+
+    for (int i = 0; i < device->effect_count; i++) {
+        effect = &device->effects[i];
+        if (effect->queue_count == 0) {
+            effect->queue_last = -1;
+        }
+    }
+
+    pthread_spin_unlock(&device->effects_lock);
+
+    for (int i = 0; i < count; i++) {
+        if (ffbt_get_device(sending[i].fd) != device) {
+            // Closed while queued
+            continue;
+        }
+        if (sending[i].op == FFBT_OP_UPLOAD) {
+            if (ffbt_device_ioctl(device, sending[i].fd, EVIOCSFF, (char*) &sending[i].effect) == 0 &&
+                    enable_upload_cache) {
+                ffbt_upload_cache_store(device, sending[i].fd, &sending[i].effect);
+            }
+        } else {
+            memset(&event, 0, sizeof(event));
+            event.type = EV_FF;
+            event.code = sending[i].id;
+            event.value = sending[i].value;
+            ffbt_device_write(device, sending[i].fd, &event, sizeof(event));
+        }
+    }
+
+    pthread_mutex_unlock(&device->throttle_drain_lock);
+}
+
+/*
+ * Tells if a command can take the place of the last one queued for its id.
+ * Uploads replace uploads and plays replace plays, but a stop never
+ * replaces a play or the other way around.
+ */
+static bool ffbt_throttle_can_merge(const struct ffbt_throttle_command *queued,
+        const struct ffbt_throttle_command *command)
+{
+    if (queued->op != command->op || queued->fd != command->fd) {
+        return false;
+    }
+
+    return command->op == FFBT_OP_UPLOAD || (queued->value > 0) == (command->value > 0);
+}
+
+/*
+ * Queues a command to be sent by the throttle thread. A command replaces
+ * the last one queued for its id when they can be merged, keeping its place
+ * in the queue, otherwise it's added at the end. When the queue is full it's
+ * sent in full right away to make room. Returns false when the command
+ * can't be queued for lack of memory, it has to be sent right away then.
+ */
+static bool ffbt_throttle_push(struct ffbt_device *device, const struct ffbt_throttle_command *command)
+{
+    struct ffbt_effect_state *effect;
+    int last;
+
+    pthread_spin_lock(&device->effects_lock);
+    while (1) {
+        effect = ffbt_get_effect(device, command->id);
+        if (effect == NULL) {
+            pthread_spin_unlock(&device->effects_lock);
+            return false;
+        }
+
+        if (command->op == FFBT_OP_UPLOAD) {
+            effect->type = command->effect.type;
+        }
+
+        last = effect->queue_last;
+        if (last >= 0 && ffbt_throttle_can_merge(&device->throttle_queue[last], command)) {
+            device->throttle_queue[last] = *command;
+            ffbt_count(device, coalesced);
+            break;
+        }
+
+        if (device->throttle_queue_length < FFBTOOLS_THROTTLE_QUEUE_SIZE) {
+            effect->queue_last = device->throttle_queue_length;
+            effect->queue_count++;
+            device->throttle_queue[device->throttle_queue_length++] = *command;
+            ffbt_throttle_set_queued(device, device->throttle_queue_length);
+            break;
+        }
+
+        pthread_spin_unlock(&device->effects_lock);
+        ffbt_throttle_drain(device, ffbt_now(), true);
+        pthread_spin_lock(&device->effects_lock);
+    }
+    pthread_spin_unlock(&device->effects_lock);
+
+    ffbt_throttle_wake(device);
+
+    return true;
+}
+
+/*
+ * Sleeps until some command is queued, then sends the queued commands at
+ * most once per interval.
+ */
+static void *ffbt_throttle_function(void *arg)
+{
+    struct ffbt_device *device = arg;
+    struct timespec next_flush;
+    uint64_t now;
+    uint64_t last_flush = 0;
+
+    while (!atomic_load(&throttle_stop)) {
+        atomic_store(&device->throttle_idle, 1);
+        if (atomic_load(&device->throttle_queued) == 0) {
+            ffbt_futex_wait(&device->throttle_idle, 1);
+        }
+        atomic_store(&device->throttle_idle, 0);
+
+        now = ffbt_now();
+        if (now < last_flush + device->throttle_interval) {
+            next_flush.tv_sec = (last_flush + device->throttle_interval) / 1000000000;
+            next_flush.tv_nsec = (last_flush + device->throttle_interval) % 1000000000;
+            while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next_flush, NULL) == EINTR);
+            now = ffbt_now();
+        }
+        last_flush = now;
+
+        ffbt_throttle_drain(device, now, false);
+    }
+
+    return NULL;
+}
+
+/*
+ * Forgets an effect when it's removed, with its queued commands.
+ */
+static void ffbt_forget_effect(struct ffbt_device *device, int id)
+{
+    struct ffbt_effect_state *effect;
+    int kept = 0;
+
+    pthread_spin_lock(&device->effects_lock);
+    if (ffbt_find_effect(device, id) != NULL) {
+        for (int i = 0; i < device->throttle_queue_length; i++) {
+            if (device->throttle_queue[i].id == id) {
+                continue;
+            }
+            effect = ffbt_find_effect(device, device->throttle_queue[i].id);
+            effect->queue_last = kept;
+            device->throttle_queue[kept++] = device->throttle_queue[i];
+        }
+        device->throttle_queue_length = kept;
+        ffbt_throttle_set_queued(device, kept);
+
+        ffbt_remove_effect(device, id);
+    }
+    pthread_spin_unlock(&device->effects_lock);
+}
+
+/*
+ * Levels within the tolerance of the cached ones are taken as equal.
+ */
+static void ffbt_tolerate(int16_t *level, int16_t cached)
+{
+    if (abs(*level - cached) < upload_cache_tolerance) {
+        *level = cached;
+    }
+}
+
+static void ffbt_cache_write_begin(struct ffbt_cache_slot *slot)
+{
+    unsigned sequence = atomic_load_explicit(&slot->sequence, memory_order_relaxed);
+
+    while ((sequence & 1) || !atomic_compare_exchange_weak_explicit(&slot->sequence, &sequence, sequence + 1,
+                memory_order_acquire, memory_order_relaxed)) {
+        sequence = atomic_load_explicit(&slot->sequence, memory_order_relaxed);
+    }
+    atomic_thread_fence(memory_order_release);
+}
+
+static void ffbt_cache_write_end(struct ffbt_cache_slot *slot)
+{
+    atomic_fetch_add_explicit(&slot->sequence, 1, memory_order_release);
+}
+
+/*
+ * Copies a slot consistently without stopping writers.
+ */
+static void ffbt_cache_read(struct ffbt_cache_slot *slot, int *id, int *fd, struct ffbt_effect *effect)
+{
+    unsigned sequence;
+
+    while (true) {
+        sequence = atomic_load_explicit(&slot->sequence, memory_order_acquire);
+        if (sequence & 1) {
+            continue;
+        }
+        *id = slot->id;
+        *fd = slot->fd;
+        memcpy(effect, &slot->effect, sizeof(*effect));
+        atomic_thread_fence(memory_order_acquire);
+        if (atomic_load_explicit(&slot->sequence, memory_order_relaxed) == sequence) {
+            break;
+        }
+    }
+}
+
+static struct ffbt_cache_slot *ffbt_cache_slot(struct ffbt_device *device, int id)
+{
+    return &device->upload_cache[id & (FFBTOOLS_UPLOAD_CACHE_SLOTS - 1)];
+}
+
+/*
+ * Tells if an upload is the same as the last one sent for its id on this
+ * fd, so it can be skipped. Custom waveforms are never taken as equal
+ * since their data isn't compared.
+ */
+static bool ffbt_upload_cache_match(struct ffbt_device *device, int fd, const struct ff_effect *effect)
+{
+    struct ffbt_effect cache;
+    struct ff_effect tolerated;
+    struct ffbt_effect packed;
+    int cache_id;
+    int cache_fd;
+
+    if (effect->id < 0 || (effect->type == FF_PERIODIC && effect->u.periodic.waveform == FF_CUSTOM)) {
+        return false;
+    }
+
+    ffbt_cache_read(ffbt_cache_slot(device, effect->id), &cache_id, &cache_fd, &cache);
+    if (cache_id != effect->id || cache_fd != fd) {
+        return false;
+    }
+
+    memcpy(&tolerated, effect, sizeof(tolerated));
+
+    if (upload_cache_tolerance > 0 && cache.type == effect->type) {
+        struct ff_effect cached;
+
+        ffbt_effect_unpack(&cached, &cache);
+        switch (effect->type) {
+            case FF_CONSTANT:
+                ffbt_tolerate(&tolerated.u.constant.level, cached.u.constant.level);
+                break;
+            case FF_RAMP:
+                ffbt_tolerate(&tolerated.u.ramp.start_level, cached.u.ramp.start_level);
+                ffbt_tolerate(&tolerated.u.ramp.end_level, cached.u.ramp.end_level);
+                break;
+            case FF_PERIODIC:
+                ffbt_tolerate(&tolerated.u.periodic.magnitude, cached.u.periodic.magnitude);
+                ffbt_tolerate(&tolerated.u.periodic.offset, cached.u.periodic.offset);
+                break;
+        }
+    }
+
+    packed = ffbt_effect_pack(&tolerated);
+
+    return !memcmp(&packed, &cache, sizeof(packed));
+}
+
+static void ffbt_upload_cache_store(struct ffbt_device *device, int fd, const struct ff_effect *effect)
+{
+    struct ffbt_cache_slot *slot;
+    struct ffbt_effect packed;
+
+    if (effect->id < 0) {
+        return;
+    }
+
+    packed = ffbt_effect_pack(effect);
+    slot = ffbt_cache_slot(device, effect->id);
+
+    ffbt_cache_write_begin(slot);
+    slot->id = effect->id;
+    slot->fd = fd;
+    slot->effect = packed;
+    ffbt_cache_write_end(slot);
+}
+
+static void ffbt_upload_cache_remove(struct ffbt_device *device, int id)
+{
+    struct ffbt_cache_slot *slot = ffbt_cache_slot(device, id);
+
+    ffbt_cache_write_begin(slot);
+    if (slot->id == id) {
+        slot->id = -1;
+    }
+    ffbt_cache_write_end(slot);
+}
+
+/*
+ * Forgets the uploads cached for a closed fd.
+ */
+static void ffbt_upload_cache_forget(struct ffbt_device *device, int fd)
+{
+    struct ffbt_cache_slot *slot;
+
+    for (int i = 0; i < FFBTOOLS_UPLOAD_CACHE_SLOTS; i++) {
+        slot = &device->upload_cache[i];
+        ffbt_cache_write_begin(slot);
+        if (slot->fd == fd) {
+            slot->id = -1;
+        }
+        ffbt_cache_write_end(slot);
+    }
+}
+
+static bool ffbt_is_condition(uint16_t type)
+{
+    return type == FF_SPRING || type == FF_DAMPER || type == FF_FRICTION || type == FF_INERTIA;
+}
+
+/*
+ * Adds the condition effects to the features reported by the device, so
+ * applications upload them to be rendered.
+ */
+static void ffbt_render_features(uint8_t *features, size_t size)
+{
+    static const int conditions[] = {FF_SPRING, FF_DAMPER, FF_FRICTION, FF_INERTIA};
+
+    for (size_t i = 0; i < sizeof(conditions) / sizeof(conditions[0]); i++) {
+        if ((size_t)conditions[i] / 8 < size) {
+            features[conditions[i] / 8] |= 1 << conditions[i] % 8;
+        }
+    }
+}
+
+static void ffbt_render_wake(struct ffbt_device *device)
+{
+    if (atomic_load(&device->render_idle) && atomic_exchange(&device->render_idle, 0)) {
+        ffbt_futex_wake(&device->render_idle);
+    }
+}
+
+static struct ffbt_condition *ffbt_find_condition(struct ffbt_device *device, int id)
+{
+    for (int i = 0; i < FFBTOOLS_MAX_CONDITIONS; i++) {
+        if (device->conditions[i].id == id && id >= 0) {
+            return &device->conditions[i];
+        }
+    }
+
+    return NULL;
+}
+
+/*
+ * Keeps an uploaded condition effect to be rendered. New effects get an id
+ * the device doesn't use. Returns 0 or a negative error code like the
+ * kernel does.
+ */
+static int ffbt_render_upload(struct ffbt_device *device, int fd, struct ff_effect *effect)
+{
+    struct ffbt_condition *condition;
+    int result = 0;
+
+    pthread_spin_lock(&device->render_lock);
+    if (effect->id == -1) {
+        condition = NULL;
+        for (int i = 0; i < FFBTOOLS_MAX_CONDITIONS && condition == NULL; i++) {
+            if (device->conditions[i].id < 0) {
+                condition = &device->conditions[i];
+            }
+        }
+        if (condition == NULL) {
+            result = -ENOSPC;
+        } else {
+            effect->id = atomic_fetch_add(&device->last_effect_used, 1);
+            condition->id = effect->id;
+            condition->fd = fd;
+            condition->playing = false;
+        }
+    } else {
+        condition = ffbt_find_condition(device, effect->id);
+        if (condition == NULL || condition->fd != fd) {
+            result = -EINVAL;
+        }
+    }
+    if (result == 0) {
+        condition->effect = *effect;
+        device->render_fd = fd;
+    }
+    pthread_spin_unlock(&device->render_lock);
+
+    if (result == 0) {
+        ffbt_render_wake(device);
+    }
+
+    return result;
+}
+
+/*
+ * Starts or stops a rendered condition effect. Returns false if the id
+ * isn't one of them or it was uploaded through another fd.
+ */
+static bool ffbt_render_play(struct ffbt_device *device, int fd, int id, int count)
+{
+    struct ffbt_condition *condition;
+    bool found;
+
+    pthread_spin_lock(&device->render_lock);
+    condition = ffbt_find_condition(device, id);
+    found = condition != NULL && condition->fd == fd;
+    if (found) {
+        condition->playing = count > 0;
+        condition->count = count;
+        condition->start = ffbt_now();
+    }
+    pthread_spin_unlock(&device->render_lock);
+
+    if (found) {
+        ffbt_render_wake(device);
+    }
+
+    return found;
+}
+
+/*
+ * Removes a rendered condition effect. Returns false if the id isn't one
+ * of them or it was uploaded through another fd.
+ */
+static bool ffbt_render_remove(struct ffbt_device *device, int fd, int id)
+{
+    struct ffbt_condition *condition;
+    bool found;
+
+    pthread_spin_lock(&device->render_lock);
+    condition = ffbt_find_condition(device, id);
+    found = condition != NULL && condition->fd == fd;
+    if (found) {
+        condition->id = -1;
+        condition->playing = false;
+    }
+    pthread_spin_unlock(&device->render_lock);
+
+    if (found) {
+        ffbt_render_wake(device);
+    }
+
+    return found;
+}
+
+/*
+ * Forgets the condition effects of a closed fd. The device releases the
+ * effect rendering them by itself.
+ */
+static void ffbt_render_forget(struct ffbt_device *device, int fd)
+{
+    pthread_mutex_lock(&device->render_send_lock);
+    pthread_spin_lock(&device->render_lock);
+    for (int i = 0; i < FFBTOOLS_MAX_CONDITIONS; i++) {
+        if (device->conditions[i].fd == fd) {
+            device->conditions[i].id = -1;
+            device->conditions[i].playing = false;
+        }
+    }
+    if (device->render_fd == fd) {
+        device->render_fd = -1;
+        device->render_id = -1;
+        device->render_level = 0;
+    }
+    pthread_spin_unlock(&device->render_lock);
+    pthread_mutex_unlock(&device->render_send_lock);
+}
+
+/*
+ * Force of a condition for the given axis metric, both normalized to
+ * [-1, 1]. It opposes the metric beyond the dead band around the center,
+ * growing with the coefficient of that side up to its saturation. Friction
+ * is a constant force against the movement.
+ */
+static double ffbt_condition_force(uint16_t type, const struct ff_condition_effect *condition, double metric)
+{
+    double half_band = condition->deadband / 65535.0;
+    double offset = metric - condition->center / 32767.0;
+    double coefficient;
+    double saturation;
+    double force;
+
+    if (offset > half_band) {
+        offset -= half_band;
+        coefficient = condition->right_coeff / 32767.0;
+        saturation = condition->right_saturation / 65535.0;
+    } else if (offset < -half_band) {
+        offset += half_band;
+        coefficient = condition->left_coeff / 32767.0;
+        saturation = condition->left_saturation / 65535.0;
+    } else {
+        return 0;
+    }
+
+    if (type == FF_FRICTION) {
+        force = offset > 0 ? -coefficient : coefficient;
+    } else {
+        force = -offset * coefficient;
+    }
+
+    // Zero saturation is taken as no limit, many games leave it unset
+    if (saturation > 0) {
+        if (force > saturation) {
+            force = saturation;
+        } else if (force < -saturation) {
+            force = -saturation;
+        }
+    }
+
+    return force;
+}
+
+/*
+ * Tells if a condition effect is within its replay time, counting the
+ * delay and the repetitions it was started with.
+ */
+static bool ffbt_condition_active(const struct ffbt_condition *condition, uint64_t now)
+{
+    uint64_t delay = condition->effect.replay.delay * (uint64_t)1000000;
+    uint64_t length = condition->effect.replay.length * (uint64_t)1000000;
+
+    if (!condition->playing || now < condition->start + delay) {
+        return false;
+    }
+
+    return length == 0 || now < condition->start + (delay + length) * condition->count;
+}
+
+/*
+ * Sends the rendered force as the level of a constant effect, uploading
+ * and starting it the first time.
+ */
+static void ffbt_render_send(struct ffbt_device *device, int fd, int16_t level)
+{
+    struct ff_effect effect;
+    struct input_event event;
+
+    memset(&effect, 0, sizeof(effect));
+    effect.type = FF_CONSTANT;
+    effect.id = device->render_id;
+    effect.direction = enable_force_inversion ? 0xC000 : 0x4000;
+    effect.u.constant.level = level;
+
+    if (ffbt_device_ioctl(device, fd, EVIOCSFF, (char*) &effect) < 0) {
+        return;
+    }
+    device->render_level = level;
+
+    if (device->render_id == -1) {
+        device->render_id = effect.id;
+
+        memset(&event, 0, sizeof(event));
+        event.type = EV_FF;
+        event.code = effect.id;
+        event.value = 1;
+        ffbt_device_write(device, fd, &event, sizeof(event));
+    }
+}
+
+/*
+ * Removes the constant effect sending the rendered force, so no force is
+ * left on the wheel when there are no condition effects.
+ */
+static void ffbt_render_release(struct ffbt_device *device)
+{
+    int fd;
+
+    pthread_mutex_lock(&device->render_send_lock);
+    pthread_spin_lock(&device->render_lock);
+    fd = device->render_fd;
+    pthread_spin_unlock(&device->render_lock);
+    if (fd >= 0 && device->render_id != -1) {
+        ffbt_device_ioctl(device, fd, EVIOCRMFF, (char*)(intptr_t) device->render_id);
+    }
+    device->render_id = -1;
+    device->render_level = 0;
+    pthread_mutex_unlock(&device->render_send_lock);
+}
+
+/*
+ * Renders the playing condition effects at a fixed rate. Every tick reads
+ * the wheel position, derives its velocity and acceleration, and sends the
+ * sum of the condition forces. The device reports the position less often
+ * than the ticks, so the derivatives are taken between the reports and
+ * low-pass filtered. The loop doesn't allocate nor block besides
+ * the device calls, and it sleeps while there are no condition effects.
+ */
+static void *ffbt_render_function(void *arg)
+{
+    struct ffbt_device *device = arg;
+    struct ffbt_condition conditions[FFBTOOLS_MAX_CONDITIONS];
+    struct input_absinfo axis;
+    struct timespec deadline_time;
+    uint64_t deadline = 0;
+    uint64_t now;
+    uint64_t latency;
+    double position = 0;
+    double velocity = 0;
+    double acceleration = 0;
+    double sample_velocity = 0;
+    double sample_acceleration = 0;
+    double last_position = 0;
+    uint64_t last_sample = 0;
+    double alpha = device->render_interval / (FFBTOOLS_RENDER_FILTER_TIME + device->render_interval);
+    double dt;
+    double force;
+    double metric;
+    bool moving = false;
+    bool present;
+    int count;
+    int fd;
+
+    while (!atomic_load(&render_stop)) {
+        pthread_spin_lock(&device->render_lock);
+        present = false;
+        for (int i = 0; i < FFBTOOLS_MAX_CONDITIONS; i++) {
+            present |= device->conditions[i].id >= 0;
+        }
+        pthread_spin_unlock(&device->render_lock);
+
+        if (!present) {
+            ffbt_render_release(device);
+            atomic_store(&device->render_idle, 1);
+            ffbt_futex_wait(&device->render_idle, 1);
+            atomic_store(&device->render_idle, 0);
+            moving = false;
+            deadline = 0;
+            continue;
+        }
+
+        now = ffbt_now();
+        if (deadline == 0 || now > deadline + device->render_interval) {
+            // Restart the schedule instead of catching up
+            deadline = now;
+        } else {
+            deadline += device->render_interval;
+            deadline_time.tv_sec = deadline / 1000000000;
+            deadline_time.tv_nsec = deadline % 1000000000;
+            while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &deadline_time, NULL) == EINTR);
+        }
+
+        // The fd can't be closed while it's in use
+        pthread_mutex_lock(&device->render_send_lock);
+        pthread_spin_lock(&device->render_lock);
+        fd = device->render_fd;
+        count = 0;
+        for (int i = 0; i < FFBTOOLS_MAX_CONDITIONS; i++) {
+            if (device->conditions[i].id >= 0) {
+                conditions[count++] = device->conditions[i];
+            }
+        }
+        pthread_spin_unlock(&device->render_lock);
+
+        if (fd < 0 || _ioctl(fd, EVIOCGABS(ABS_X), (char*) &axis) < 0 || axis.maximum <= axis.minimum) {
+            pthread_mutex_unlock(&device->render_send_lock);
+            continue;
+        }
+
+        now = ffbt_now();
+        position = (2.0 * axis.value - axis.minimum - axis.maximum) / (axis.maximum - axis.minimum);
+        if (!moving) {
+            velocity = acceleration = 0;
+            sample_velocity = sample_acceleration = 0;
+            last_position = position;
+            last_sample = now;
+            moving = true;
+        } else if (position != last_position) {
+            dt = (now - last_sample) / 1e9;
+            sample_acceleration = ((position - last_position) / dt - sample_velocity) / dt;
+            sample_velocity = (position - last_position) / dt;
+            last_position = position;
+            last_sample = now;
+        } else if (now - last_sample > FFBTOOLS_RENDER_STILL_TIME) {
+            sample_velocity = sample_acceleration = 0;
+        }
+        velocity += (sample_velocity - velocity) * alpha;
+        acceleration += (sample_acceleration - acceleration) * alpha;
+
+        force = 0;
+        for (int i = 0; i < count; i++) {
+            if (!ffbt_condition_active(&conditions[i], now)) {
+                continue;
+            }
+
+            switch (conditions[i].effect.type) {
+                case FF_SPRING:
+                    metric = position;
+                    break;
+                case FF_INERTIA:
+                    metric = acceleration;
+                    break;
+                default:
+                    metric = velocity;
+                    break;
+            }
+            force += ffbt_condition_force(conditions[i].effect.type,
+                    &conditions[i].effect.u.condition[0], metric);
+        }
+
+        if (force > 1) {
+            force = 1;
+        } else if (force < -1) {
+            force = -1;
+        }
+
+        if ((int16_t)(force * 0x7fff) != device->render_level || device->render_id == -1) {
+            ffbt_render_send(device, fd, force * 0x7fff);
+        }
+        pthread_mutex_unlock(&device->render_send_lock);
+
+        latency = ffbt_now() - deadline;
+        device->render_ticks++;
+        if (latency > device->render_max_latency) {
+            device->render_max_latency = latency;
+        }
+    }
+
+    return NULL;
+}
+
+/* Makes effects with no duration last forever */
+static bool ffbt_duration_fix(struct ff_effect *effect)
+{
+    if (effect->replay.length != 0) {
+        return false;
+    }
+
+    effect->replay.length = 0xFFFF;
+
+    return true;
+}
+
+/* Turns effects pointing down or up to the left, along the wheel axis */
+static bool ffbt_direction_fix(struct ff_effect *effect)
+{
+    if (effect->direction != 0 && effect->direction != 0x8000) {
+        return false;
+    }
+
+    effect->direction = 0x4000;
+
+    return true;
+}
+
+/* Turns the direction of the effect half a turn */
+static bool ffbt_force_inversion(struct ff_effect *effect)
+{
+    effect->direction -= 0x8000;
+
+    return true;
+}
+
+/* Scales offset and phase from the DirectInput ranges */
+static bool ffbt_offset_fix(struct ff_effect *effect)
+{
+    effect->u.periodic.offset = (int)effect->u.periodic.offset * 0x7fff / 10000;
+    effect->u.periodic.phase = (int)effect->u.periodic.phase * 0xffff / 35999;
+
+    return true;
+}
+
+/*
+ * Builds the table of fixes enabled, so uploads don't check every option.
+ */
+static void ffbt_init_upload_fixes()
+{
+    if (enable_duration_fix) {
+        upload_fixes[upload_fix_count++] = (struct ffbt_upload_fix) { ffbt_duration_fix, FFBT_TAG_DURATION_FIX, 0 };
+    }
+    if (enable_direction_fix) {
+        upload_fixes[upload_fix_count++] = (struct ffbt_upload_fix) { ffbt_direction_fix, FFBT_TAG_DIRECTION_FIX, 0 };
+    }
+    if (enable_force_inversion) {
+        upload_fixes[upload_fix_count++] = (struct ffbt_upload_fix) { ffbt_force_inversion, FFBT_TAG_FORCE_INVERSION, 0 };
+    }
+    if (enable_offset_fix) {
+        upload_fixes[upload_fix_count++] = (struct ffbt_upload_fix) { ffbt_offset_fix, FFBT_TAG_OFFSET_FIX, FF_PERIODIC };
+    }
+}
+
+/*
+ * Applies the enabled fixes to an upload. When logging, the upload is
+ * commented out if some fix could apply to it, and every change made is
+ * logged with its tag.
+ */
+static void ffbt_apply_upload_fixes(struct ffbt_device *device, int fd, struct ff_effect *effect)
+{
+    const struct ffbt_upload_fix *fix;
+    bool modified = false;
+
+    if (enable_logger) {
+        for (int i = 0; i < upload_fix_count; i++) {
+            if (upload_fixes[i].type == 0 || upload_fixes[i].type == effect->type) {
+                modified = true;
+                break;
+            }
+        }
+        report(.op = FFBT_OP_UPLOAD, .dev = device->index, .fd = fd,
+                .flags = modified ? FFBT_REC_COMMENTED : 0,
+                .effect = ffbt_effect_pack(effect));
+    }
+
+    for (int i = 0; i < upload_fix_count; i++) {
+        fix = &upload_fixes[i];
+        if ((fix->type == 0 || fix->type == effect->type) && fix->apply(effect)) {
+            report(.op = FFBT_OP_UPLOAD, .dev = device->index, .fd = fd,
+                    .tag = fix->tag, .effect = ffbt_effect_pack(effect));
+        }
+    }
+}
+
+/*
+ * Gets the item for a device from a comma separated list. When the list is
+ * shorter than the number of devices its last item is used.
+ */
+static const char *ffbt_get_list_item(const char *list, int index, char *item, size_t size)
+{
+    const char *end;
+
+    if (list == NULL) {
+        return NULL;
+    }
+
+    while (index-- > 0 && strchr(list, ',') != NULL) {
+        list = strchr(list, ',') + 1;
+    }
+
+    end = strchr(list, ',');
+    snprintf(item, size, "%.*s", end != NULL ? (int)(end - list) : (int)strlen(list), list);
+
+    return item;
+}
+
+static void ffbt_init_devices(const char *str_dev_major, const char *str_dev_minor)
+{
+    struct ffbt_device *device;
+    char major[32];
+    char minor[32];
+    int count = 1;
+
+    if (str_dev_major == NULL || str_dev_minor == NULL) {
+        return;
+    }
+
+    for (const char *c = str_dev_major; *c != '\0'; c++) {
+        count += *c == ',';
+    }
+    if (count > FFBTOOLS_MAX_DEVICES) {
+        fprintf(stderr, "Only the first %d devices are wrapped.\n", FFBTOOLS_MAX_DEVICES);
+        count = FFBTOOLS_MAX_DEVICES;
+    }
+
+    for (int i = 0; i < count; i++) {
+        device = &devices[device_count];
+        device->major = strtol(ffbt_get_list_item(str_dev_major, i, major, sizeof(major)), NULL, 0);
+        device->minor = strtol(ffbt_get_list_item(str_dev_minor, i, minor, sizeof(minor)), NULL, 0);
+        if (device->major == 0 || device->minor == 0) {
+            continue;
+        }
+
+        device->index = device_count++;
+        atomic_init(&device->last_effect_used, 16);
+        pthread_spin_init(&device->effects_lock, PTHREAD_PROCESS_PRIVATE);
+    }
+}
+
+#define FFBTOOLS_DEFAULT_TIMER_INTERVAL (3000000)
+
+static uint64_t ffbt_get_timer_interval(const char *str_interval) {
+    // Use the default for invalid values
+    if (strlen(str_interval) <= 0) {
+        return FFBTOOLS_DEFAULT_TIMER_INTERVAL;
+    }
+    int param = atol(str_interval);
+    if (param < 1) {
+        return FFBTOOLS_DEFAULT_TIMER_INTERVAL;
+    }
+    return param * (uint64_t)1000000;
+}
+
+/*
+ * Parses effect type weights like "spring=4,damper=4,constant=1". Types
+ * not listed have weight 1.
+ */
+static void ffbt_get_throttle_weights(const char *str_weights)
+{
+    static const struct {
+        int type;
+        const char *name;
+    } types[] = {
+        {FF_RUMBLE, "rumble"},
+        {FF_PERIODIC, "periodic"},
+        {FF_CONSTANT, "constant"},
+        {FF_SPRING, "spring"},
+        {FF_FRICTION, "friction"},
+        {FF_DAMPER, "damper"},
+        {FF_INERTIA, "inertia"},
+        {FF_RAMP, "ramp"},
+    };
+    const char *name = str_weights;
+    const char *value;
+    size_t i;
+
+    for (i = 0; i < sizeof(throttle_weights) / sizeof(throttle_weights[0]); i++) {
+        throttle_weights[i] = 1;
+    }
+
+    while (name != NULL && *name != '\0') {
+        value = strchr(name, '=');
+        if (value == NULL) {
+            break;
+        }
+        for (i = 0; i < sizeof(types) / sizeof(types[0]); i++) {
+            if (strlen(types[i].name) == (size_t)(value - name) &&
+                    !strncmp(types[i].name, name, value - name)) {
+                int weight = atoi(value + 1);
+                throttle_weights[types[i].type - FF_EFFECT_MIN] = weight > 0 ? weight : 1;
+                break;
+            }
+        }
+        if (i == sizeof(types) / sizeof(types[0])) {
+            fprintf(stderr, "Unknown effect type in throttling weights: %.*s\n",
+                    (int)(value - name), name);
+        }
+        name = strchr(value, ',');
+        if (name != NULL) {
+            name++;
+        }
+    }
+}
+
+static void ffbt_throttle_thread_setup(pthread_t throttle_thread)
+{
+    const char *str_cpu = getenv("FFBTOOLS_THROTTLING_CPU");
+    const char *str_priority = getenv("FFBTOOLS_THROTTLING_PRIORITY");
+    int result;
+
+    if (str_cpu != NULL && str_cpu[0] != '\0') {
+        cpu_set_t cpus;
+
+        CPU_ZERO(&cpus);
+        CPU_SET(atoi(str_cpu), &cpus);
+        result = pthread_setaffinity_np(throttle_thread, sizeof(cpus), &cpus);
+        if (result != 0) {
+            fprintf(stderr, "Cannot set the throttling thread CPU: %s\n", strerror(result));
+        }
+    }
+
+    if (str_priority != NULL && atoi(str_priority) > 0) {
+        struct sched_param param = {
+            .sched_priority = atoi(str_priority)
+        };
+
+        result = pthread_setschedparam(throttle_thread, SCHED_FIFO, &param);
+        if (result != 0) {
+            fprintf(stderr, "Cannot set the throttling thread priority: %s\n", strerror(result));
+        }
+    }
+}
+
+/*
+ * Returns the device number of the descriptor plus one, or 0 when it's not
+ * one of the wrapped devices.
+ */
+static int ffbt_check_descriptor(int fd)
+{
+    struct stat sb;
+
+    if (device_count == 0 || fstat(fd, &sb) != 0 || !S_ISCHR(sb.st_mode)) {
+        return 0;
+    }
+
+    for (int i = 0; i < device_count; i++) {
+        if (major(sb.st_rdev) == devices[i].major && minor(sb.st_rdev) == devices[i].minor) {
+            ffbt_start();
+            return i + 1;
+        }
+    }
+
+    return 0;
+}
+
+static void ffbt_set_device_fd(int fd, int device)
+{
+    if (fd >= 0 && fd < FFBTOOLS_MAX_TRACKED_FDS) {
+        atomic_store_explicit(&fd_devices[fd], device != 0 ? device : FFBT_FD_OTHER, memory_order_release);
+    }
+}
+
+/*
+ * Tells which device the descriptor is, as returned by
+ * ffbt_check_descriptor(). Descriptors are classified when they're opened,
+ * so calls to other files don't pay for a system call.
+ */
+static inline int ffbt_get_device_fd(int fd)
+{
+    if (fd >= 0 && fd < FFBTOOLS_MAX_TRACKED_FDS) {
+        int device = atomic_load_explicit(&fd_devices[fd], memory_order_acquire);
+
+        return device != FFBT_FD_OTHER ? device : 0;
+    }
+
+    return fd >= 0 ? ffbt_check_descriptor(fd) : 0;
+}
+
+static inline struct ffbt_device *ffbt_get_device(int fd)
+{
+    int device = ffbt_get_device_fd(fd);
+
+    return device != 0 ? &devices[device - 1] : NULL;
+}
+
+/*
+ * Like ffbt_get_device(), for input device calls and writes. Fds that
+ * weren't seen being opened, like the inherited ones, the ones received from
+ * other processes or opened with a raw system call, are checked the first
+ * time.
+ */
+static struct ffbt_device *ffbt_get_ffb_device(int fd)
+{
+    if (fd >= 0 && fd < FFBTOOLS_MAX_TRACKED_FDS &&
+            atomic_load_explicit(&fd_devices[fd], memory_order_acquire) == 0) {
+        ffbt_set_device_fd(fd, ffbt_check_descriptor(fd));
+    }
+
+    return ffbt_get_device(fd);
+}
+
+static void ffbt_track_fd(int fd)
+{
+    if (fd >= 0) {
+        ffbt_set_device_fd(fd, ffbt_check_descriptor(fd));
+    }
+}
+
+/*
+ * A duplicate is the same file as the original, seen or not.
+ */
+static void ffbt_copy_device_fd(int oldfd, int fd)
+{
+    if (fd < 0 || fd >= FFBTOOLS_MAX_TRACKED_FDS) {
+        return;
+    }
+
+    if (oldfd >= 0 && oldfd < FFBTOOLS_MAX_TRACKED_FDS) {
+        atomic_store_explicit(&fd_devices[fd],
+                atomic_load_explicit(&fd_devices[oldfd], memory_order_acquire), memory_order_release);
+    } else {
+        ffbt_set_device_fd(fd, ffbt_get_device_fd(oldfd));
+    }
+}
+
+/*
+ * Forgets a descriptor that is being closed, so the fd number is checked
+ * again if it's reused by a file that isn't seen being opened.
+ */
+static void ffbt_forget_fd(int fd)
+{
+    struct ffbt_device *device = ffbt_get_device(fd);
+
+    if (device != NULL && enable_upload_cache) {
+        ffbt_upload_cache_forget(device, fd);
+    }
+    if (device != NULL && enable_condition_render) {
+        ffbt_render_forget(device, fd);
+    }
+    if (fd >= 0 && fd < FFBTOOLS_MAX_TRACKED_FDS) {
+        atomic_store_explicit(&fd_devices[fd], 0, memory_order_release);
+    }
+}
+
+static void ffbt_resolve_symbols()
+{
+    _ioctl = dlsym(RTLD_NEXT, "ioctl");
+    _write = dlsym(RTLD_NEXT, "write");
+    _open = dlsym(RTLD_NEXT, "open");
+    _open64 = dlsym(RTLD_NEXT, "open64");
+    _openat = dlsym(RTLD_NEXT, "openat");
+    _openat64 = dlsym(RTLD_NEXT, "openat64");
+    __open_2_ = dlsym(RTLD_NEXT, "__open_2");
+    __open64_2_ = dlsym(RTLD_NEXT, "__open64_2");
+    __openat_2_ = dlsym(RTLD_NEXT, "__openat_2");
+    __openat64_2_ = dlsym(RTLD_NEXT, "__openat64_2");
+    _dup = dlsym(RTLD_NEXT, "dup");
+    _dup2 = dlsym(RTLD_NEXT, "dup2");
+    _dup3 = dlsym(RTLD_NEXT, "dup3");
+    _fcntl = dlsym(RTLD_NEXT, "fcntl");
+    _close = dlsym(RTLD_NEXT, "close");
+    _close_range = dlsym(RTLD_NEXT, "close_range");
+}
+
+/*
+ * Only the devices are known until one of them is used. Processes that never
+ * open them don't create the log, nor start any thread.
+ */
+static void ffbt_init()
+{
+    ffbt_resolve_symbols();
+    ffbt_init_devices(getenv("FFBTOOLS_DEV_MAJOR"), getenv("FFBTOOLS_DEV_MINOR"));
+}
+
+/*
+ * A forked child only has the thread that called fork, so it can't throttle,
+ * render or drain the log, and the log and stats are still the parent's. It
+ * keeps the fixes and sends everything straight to the driver. Children that
+ * exec are set up again from scratch.
+ */
+static void ffbt_fork_child()
+{
+    for (int i = 0; i < device_count; i++) {
+        struct ffbt_device *device = &devices[i];
+
+        device->throttling = false;
+        device->rendering = false;
+        device->latency = NULL;
+        device->stats = NULL;
+        pthread_spin_init(&device->effects_lock, PTHREAD_PROCESS_PRIVATE);
+    }
+
+    if (latency_signal_number != 0) {
+        sigaction(latency_signal_number, &latency_old_action, NULL);
+        latency_signal_number = 0;
+    }
+
+    enable_logger = 0;
+    enable_async_logger = 0;
+    enable_upload_cache = 0;
+    enable_condition_render = 0;
+    enable_latency_stats = 0;
+    enable_stats = 0;
+    log_filename = NULL;
+}
+
+/*
+ * Sets up the options, the log and the threads, the first time a device
+ * descriptor is found. It's done before the descriptor is tracked, so calls
+ * that see the device also see the setup.
+ */
+static void ffbt_setup()
+{
     const char *str_logger = getenv("FFBTOOLS_LOGGER");
+    const char *str_log_mmap = getenv("FFBTOOLS_LOG_MMAP");
     if (str_logger != NULL && strcmp(str_logger, "1") == 0) {
         const char *filename = getenv("FFBTOOLS_LOG_FILE");
-        if (filename != NULL) {
-            log_file = fopen(filename, "a");
+        if (filename != NULL && str_log_mmap != NULL && strcmp(str_log_mmap, "1") == 0) {
+            const char *str_segment_size = getenv("FFBTOOLS_LOG_SEGMENT_SIZE");
+            const char *str_max_size = getenv("FFBTOOLS_LOG_MAX_SIZE");
+            if (str_segment_size != NULL && atol(str_segment_size) > 0) {
+                log_segment_size = (size_t)atol(str_segment_size) << 20;
+            }
+            if (str_max_size != NULL && atol(str_max_size) > 0) {
+                log_max_segments = ((size_t)atol(str_max_size) << 20) / log_segment_size;
+                if (log_max_segments < 1) {
+                    log_max_segments = 1;
+                }
+            }
+            log_filename = filename;
+            enable_logger = 1;
+        } else if (filename != NULL) {
+            char name[4096];
+
+            // Every process writes its own log, named after the process id
+            snprintf(name, sizeof(name), "%s.%d", filename, getpid());
+            log_file = fopen(name, "a");
             if (log_file == NULL) {
                 printf("Cannot create log file.\n");
             } else {
@@ -210,334 +2516,512 @@ static void ffbt_init()
         enable_offset_fix = 1;
     }
 
+    ffbt_init_upload_fixes();
+
+    const char *str_upload_cache = getenv("FFBTOOLS_UPLOAD_CACHE");
+    if (str_upload_cache != NULL && strcmp(str_upload_cache, "1") == 0) {
+        enable_upload_cache = 1;
+
+        const char *str_tolerance = getenv("FFBTOOLS_UPLOAD_CACHE_TOLERANCE");
+        if (str_tolerance != NULL) {
+            upload_cache_tolerance = atoi(str_tolerance);
+        }
+
+        for (int i = 0; i < device_count; i++) {
+            devices[i].upload_cache = calloc(FFBTOOLS_UPLOAD_CACHE_SLOTS, sizeof(*devices[i].upload_cache));
+            if (devices[i].upload_cache == NULL) {
+                fprintf(stderr, "Error allocating the upload cache.\n");
+                exit(-1);
+            }
+            for (int j = 0; j < FFBTOOLS_UPLOAD_CACHE_SLOTS; j++) {
+                devices[i].upload_cache[j].id = -1;
+                devices[i].upload_cache[j].fd = -1;
+            }
+        }
+    }
+
     const char *str_throttling = getenv("FFBTOOLS_THROTTLING");
     if (str_throttling != NULL && strcmp(str_throttling, "0") != 0) {
+        const char *str_throttling_budget = getenv("FFBTOOLS_THROTTLING_BUDGET");
+        const char *str_throttling_mode = getenv("FFBTOOLS_THROTTLING_MODE");
+        char item[32];
         int result;
-        struct itimerspec timerspec;
 
-        enable_throttling = 1;
-        pthread_spin_init(&pending_effects_lock, PTHREAD_PROCESS_PRIVATE);
+        if (str_throttling_mode != NULL && !strcmp(str_throttling_mode, "leading")) {
+            throttle_leading_edge = true;
+        }
 
-        throttle_sigev.sigev_notify = SIGEV_THREAD;
-        throttle_sigev.sigev_notify_function = ffbt_throttle_function;
-        result = timer_create(CLOCK_MONOTONIC, &throttle_sigev, &throttle_timer_id);
-        if (result != 0) {
-            fprintf(stderr, "Error setting the timer: %s\n", strerror(errno));
-            exit(-1);
+        ffbt_get_throttle_weights(getenv("FFBTOOLS_THROTTLING_WEIGHTS"));
+
+        // Every device can have its own interval and budget
+        for (int i = 0; i < device_count; i++) {
+            struct ffbt_device *device = &devices[i];
+
+            ffbt_get_list_item(str_throttling, i, item, sizeof(item));
+            if (strcmp(item, "0") == 0) {
+                continue;
+            }
+
+            device->throttling = true;
+            device->throttle_interval = ffbt_get_timer_interval(item);
+            if (str_throttling_budget != NULL) {
+                device->throttle_budget = atoi(ffbt_get_list_item(str_throttling_budget, i, item, sizeof(item)));
+            }
+            device->throttle_tokens_time = ffbt_now();
+            pthread_mutex_init(&device->throttle_drain_lock, NULL);
+
+            result = pthread_create(&device->throttle_thread, NULL, ffbt_throttle_function, device);
+            if (result != 0) {
+                fprintf(stderr, "Error creating the throttling thread: %s\n", strerror(result));
+                exit(-1);
+            }
+
+            ffbt_throttle_thread_setup(device->throttle_thread);
+        }
+    }
+
+    const char *str_condition_render = getenv("FFBTOOLS_CONDITION_RENDER");
+    if (str_condition_render != NULL && strcmp(str_condition_render, "1") == 0) {
+        const char *str_render_rate = getenv("FFBTOOLS_CONDITION_RENDER_RATE");
+        int rate = FFBTOOLS_DEFAULT_RENDER_RATE;
+        int result;
+
+        enable_condition_render = 1;
+        if (str_render_rate != NULL && atoi(str_render_rate) > 0) {
+            rate = atoi(str_render_rate);
         }
 
-        ffbt_get_timer_interval(&timerspec.it_interval, str_throttling);
-        timerspec.it_value = timerspec.it_interval;
-        result = timer_settime(throttle_timer_id, 0, &timerspec, NULL);
+        for (int i = 0; i < device_count; i++) {
+            struct ffbt_device *device = &devices[i];
+
+            device->rendering = true;
+            device->render_interval = 1000000000 / rate;
+            device->render_fd = -1;
+            device->render_id = -1;
+            for (int j = 0; j < FFBTOOLS_MAX_CONDITIONS; j++) {
+                device->conditions[j].id = -1;
+                device->conditions[j].fd = -1;
+            }
+            pthread_spin_init(&device->render_lock, PTHREAD_PROCESS_PRIVATE);
+            pthread_mutex_init(&device->render_send_lock, NULL);
+
+            result = pthread_create(&device->render_thread, NULL, ffbt_render_function, device);
+            if (result != 0) {
+                fprintf(stderr, "Error creating the condition render thread: %s\n", strerror(result));
+                exit(-1);
+            }
+
+            ffbt_throttle_thread_setup(device->render_thread);
+        }
+    }
+
+    const char *str_stats = getenv("FFBTOOLS_STATS");
+    if (str_stats != NULL && strcmp(str_stats, "1") == 0) {
+        for (int i = 0; i < device_count; i++) {
+            devices[i].stats = ffbt_stats_open(&devices[i]);
+            if (devices[i].stats == NULL) {
+                fprintf(stderr, "Cannot create stats segment: %s\n", strerror(errno));
+                continue;
+            }
+            devices[i].latency = devices[i].stats->latency;
+            enable_stats = 1;
+        }
+    }
+
+    const char *str_latency_stats = getenv("FFBTOOLS_LATENCY_STATS");
+    if (str_latency_stats != NULL && strcmp(str_latency_stats, "1") == 0) {
+        const char *str_latency_file = getenv("FFBTOOLS_LATENCY_FILE");
+        const char *str_latency_signal = getenv("FFBTOOLS_LATENCY_SIGNAL");
+        struct sigaction action;
+        int result;
+
+        latency_file = stderr;
+        if (str_latency_file != NULL && *str_latency_file != '\0') {
+            latency_file = fopen(str_latency_file, "a");
+            if (latency_file == NULL) {
+                fprintf(stderr, "Cannot create latency file: %s\n", strerror(errno));
+                latency_file = stderr;
+            }
+        }
+
+        for (int i = 0; i < device_count; i++) {
+            if (devices[i].latency != NULL) {
+                continue;
+            }
+            devices[i].latency = calloc(FFBT_LATENCY_HISTOGRAMS, sizeof(*devices[i].latency));
+            if (devices[i].latency == NULL) {
+                fprintf(stderr, "Error allocating the latency histograms.\n");
+                exit(-1);
+            }
+        }
+        enable_latency_stats = 1;
+
+        sem_init(&latency_signal, 0, 0);
+        result = pthread_create(&latency_thread, NULL, ffbt_latency_function, NULL);
         if (result != 0) {
-            fprintf(stderr, "Error setting timer time: %d,%d: %s\n", result, errno, strerror(errno));
+            fprintf(stderr, "Error creating the latency thread: %s\n", strerror(result));
             exit(-1);
         }
+
+        // Wine uses SIGUSR1 and SIGUSR2 itself, a real-time signal is used instead
+        latency_signal_number = SIGRTMIN + FFBTOOLS_DEFAULT_LATENCY_SIGNAL;
+        if (str_latency_signal != NULL && strcmp(str_latency_signal, "none") == 0) {
+            latency_signal_number = 0;
+        } else if (str_latency_signal != NULL && *str_latency_signal != '\0') {
+            latency_signal_number = SIGRTMIN + atoi(str_latency_signal);
+            if (latency_signal_number < SIGRTMIN || latency_signal_number > SIGRTMAX) {
+                fprintf(stderr, "Invalid latency signal: RTMIN+%s\n", str_latency_signal);
+                latency_signal_number = 0;
+            }
+        }
+
+        if (latency_signal_number != 0) {
+            memset(&action, 0, sizeof(action));
+            action.sa_sigaction = ffbt_latency_signal_handler;
+            action.sa_flags = SA_SIGINFO | SA_RESTART;
+            sigemptyset(&action.sa_mask);
+            sigaction(latency_signal_number, &action, &latency_old_action);
+        }
     }
 
-    if (enable_logger && ftell(log_file) == 0) {
-        report("# DEVICE_NAME=%s, UPDATE_FIX=%d, "
+    if (enable_logger) {
+        int format = FFBT_TRACE_TEXT;
+        const char *str_log_format = getenv("FFBTOOLS_LOG_FORMAT");
+
+        if (str_log_format != NULL && strcmp(str_log_format, "binary") == 0) {
+            format = FFBT_TRACE_BINARY;
+        }
+
+        const char *str_log_epoch = getenv("FFBTOOLS_LOG_EPOCH");
+
+        // ffbwrap gives the start of the run in wall clock time, shell scripts can't read the monotonic clock
+        log_epoch = ffbt_now();
+        if (str_log_epoch != NULL) {
+            struct timespec real;
+            uint64_t elapsed;
+
+            clock_gettime(CLOCK_REALTIME, &real);
+            elapsed = (uint64_t)real.tv_sec * 1000000000 + real.tv_nsec - strtoull(str_log_epoch, NULL, 10);
+            if (elapsed < log_epoch) {
+                log_epoch -= elapsed;
+            }
+        }
+        snprintf(log_info, sizeof(log_info), "DEVICE_NAME=%s, UPDATE_FIX=%d, "
                 "DIRECTION_FIX=%d, DURATION_FIX=%d, FEATURES_HACK=%d, "
                 "FORCE_INVERSION=%d, IGNORE_SET_GAIN=%d, OFFSET_FIX=%d, "
-                "THROTTLING=%s",
+                "THROTTLING=%s, UPLOAD_CACHE=%d, CONDITION_RENDER=%d",
                 getenv("FFBTOOLS_DEVICE_NAME"), enable_update_fix,
                 enable_direction_fix, enable_duration_fix, enable_features_hack,
                 enable_force_inversion, ignore_set_gain, enable_offset_fix,
-                str_throttling == NULL ? "0" : str_throttling);
+                str_throttling == NULL ? "0" : str_throttling, enable_upload_cache,
+                enable_condition_render);
+        if (log_filename != NULL) {
+            atomic_store(&log_segment, ffbt_log_segment_open(0));
+            if (atomic_load(&log_segment) == NULL) {
+                fprintf(stderr, "Cannot create log segment: %s\n", strerror(errno));
+                log_filename = NULL;
+                enable_logger = 0;
+            } else {
+                int result = pthread_create(&log_segment_thread, NULL, ffbt_log_segment_function, NULL);
+                if (result != 0) {
+                    fprintf(stderr, "Error creating the log segment thread: %s\n", strerror(result));
+                    exit(-1);
+                }
+                ffbt_log_origin();
+            }
+        } else {
+            int empty = ftell(log_file) == 0;
+
+            ffbt_trace_open_write(&log_trace, log_file, format, log_epoch, log_info);
+            if (empty) {
+                ffbt_log_origin();
+            }
+            fflush(log_file);
+        }
+    }
+
+    const char *str_async_logger = getenv("FFBTOOLS_ASYNC_LOGGER");
+    if (enable_logger && log_filename == NULL && str_async_logger != NULL && strcmp(str_async_logger, "1") == 0) {
+        int result;
+
+        pthread_key_create(&log_ring_key, ffbt_log_ring_release);
+
+        result = pthread_create(&log_drain_thread, NULL, ffbt_log_drain_function, NULL);
+        if (result != 0) {
+            fprintf(stderr, "Error creating the logger thread: %s\n", strerror(result));
+        } else {
+            enable_async_logger = 1;
+        }
     }
+
+    setup_pid = getpid();
+    pthread_atfork(NULL, NULL, ffbt_fork_child);
+
+    atomic_store(&setup_done, 1);
 }
 
-static void ffbt_close()
+static void ffbt_start()
 {
-    if (enable_throttling) {
-        timer_delete(throttle_timer_id);
-        pthread_spin_destroy(&pending_effects_lock);
-    }
+    pthread_once(&setup_once, ffbt_setup);
 }
 
-static int ffbt_check_descriptor(int fd)
+static void ffbt_close()
 {
-    if (dev_major != 0 && dev_minor != 0) {
-        struct stat sb;
+    // Processes forked without the atfork handler don't have the threads
+    if (!atomic_load(&setup_done) || getpid() != setup_pid) {
+        return;
+    }
+
+    atomic_store(&throttle_stop, 1);
+    atomic_store(&render_stop, 1);
+    for (int i = 0; i < device_count; i++) {
+        struct ffbt_device *device = &devices[i];
+
+        if (device->rendering) {
+            atomic_store(&device->render_idle, 0);
+            ffbt_futex_wake(&device->render_idle);
+            pthread_join(device->render_thread, NULL);
+            report(.op = FFBT_OP_NOTE, .tag = FFBT_TAG_RENDERED, .dev = device->index,
+                    .value = device->render_ticks, .aux = device->render_max_latency / 1000);
+        }
 
-        fstat(fd, &sb);
+        if (device->throttling) {
+            atomic_store(&device->throttle_idle, 0);
+            ffbt_futex_wake(&device->throttle_idle);
+            pthread_join(device->throttle_thread, NULL);
+            ffbt_throttle_drain(device, ffbt_now(), true);
+        }
 
-        if (major(sb.st_rdev) == dev_major && minor(sb.st_rdev) == dev_minor) {
-            return 1;
+        if (enable_upload_cache) {
+            report(.op = FFBT_OP_NOTE, .tag = FFBT_TAG_SUPPRESSED, .dev = device->index,
+                    .value = atomic_load(&device->upload_cache_hits));
         }
     }
 
-    return 0;
+    if (enable_latency_stats) {
+        atomic_store(&latency_stop, 1);
+        sem_post(&latency_signal);
+        pthread_join(latency_thread, NULL);
+        for (int i = 0; i < device_count; i++) {
+            ffbt_latency_print(&devices[i]);
+        }
+    }
+
+    if (enable_stats) {
+        char name[64];
+
+        // The segments stay mapped, other threads can still be using them
+        for (int i = 0; i < device_count; i++) {
+            if (devices[i].stats != NULL) {
+                snprintf(name, sizeof(name), FFBT_STATS_NAME, getpid(), devices[i].index);
+                shm_unlink(name);
+            }
+        }
+    }
+
+    if (log_filename != NULL) {
+        ffbt_log_segment_close();
+    }
+
+    if (enable_async_logger) {
+        atomic_store(&log_drain_stop, 1);
+        pthread_join(log_drain_thread, NULL);
+        ffbt_log_drain();
+    }
 }
 
 int ioctl(int fd, unsigned long request, char *argp)
 {
-    static char string[256];
-    static char effect_params[256];
+    struct ffbt_device *device;
     struct ff_effect *effect = NULL;
-    char *waveform = "UNKNOWN";
     bool throttled = false;
+    bool suppressed = false;
+    bool rendered = false;
+
+    if (_IOC_TYPE(request) == 'E') {
+        device = ffbt_get_ffb_device(fd);
+    } else {
+        device = ffbt_get_device(fd);
+    }
 
-    if (!ffbt_check_descriptor(fd)) {
+    if (device == NULL) {
         return _ioctl(fd, request, argp);
     }
 
     switch (ioctlRequestCode(request)) {
         case ioctlRequestCode(EVIOCGBIT(EV_FF, 0)):
-            report("> QUERY # Query force feedback features.");
+            report(.op = FFBT_OP_QUERY, .dev = device->index, .fd = fd);
             break;
         case ioctlRequestCode(EVIOCGEFFECTS):
-            report("> SLOTS # Get maximum number of simultaneous effects in memory.");
+            report(.op = FFBT_OP_SLOTS, .dev = device->index, .fd = fd);
             break;
         case ioctlRequestCode(EVIOCRMFF):
-            report("> REMOVE %d # Remove effect from memory.", (int)((intptr_t)argp));
+            report(.op = FFBT_OP_REMOVE, .dev = device->index, .fd = fd, .value = (int)((intptr_t)argp));
+            ffbt_count(device, commands[FFBT_CALL_REMOVE]);
+            if (device->rendering && ffbt_render_remove(device, fd, (int)((intptr_t)argp))) {
+                rendered = true;
+            } else {
+                if (device->throttling) {
+                    ffbt_forget_effect(device, (int)((intptr_t)argp));
+                }
+                if (enable_upload_cache) {
+                    ffbt_upload_cache_remove(device, (int)((intptr_t)argp));
+                }
+            }
             break;
         case ioctlRequestCode(EVIOCSFF):
             effect = (struct ff_effect*) argp;
+            ffbt_count(device, commands[FFBT_CALL_UPLOAD]);
 
-            char *type = "UNKNOWN";
-            switch (effect->type) {
-                case FF_RUMBLE:
-                    type = "RUMBLE";
-                    snprintf(effect_params, sizeof(effect_params),
-                            "strong:%u, weak:%u",
-                            effect->u.rumble.strong_magnitude,
-                            effect->u.rumble.weak_magnitude);
-                    break;
-                case FF_CONSTANT:
-                    type = "CONSTANT";
-                    snprintf(effect_params, sizeof(effect_params),
-                            "level:%d attack_length:%u attack_level:%u "
-                            "fade_length:%u fade_level:%u",
-                            effect->u.constant.level,
-                            effect->u.constant.envelope.attack_length,
-                            effect->u.constant.envelope.attack_level,
-                            effect->u.constant.envelope.fade_length,
-                            effect->u.constant.envelope.fade_level);
-                    break;
-                case FF_RAMP:
-                    type = "RAMP";
-                    snprintf(effect_params, sizeof(effect_params),
-                            "start_level:%d end_level:%d attack_length:%u "
-                            "attack_level:%u fade_length:%u fade_level:%u",
-                            effect->u.ramp.start_level,
-                            effect->u.ramp.end_level,
-                            effect->u.ramp.envelope.attack_length,
-                            effect->u.ramp.envelope.attack_level,
-                            effect->u.ramp.envelope.fade_length,
-                            effect->u.ramp.envelope.fade_level);
-                    break;
-                case FF_PERIODIC:
-                    type = "PERIODIC";
-                    switch (effect->u.periodic.waveform) {
-                        case FF_SQUARE:
-                            waveform = "SQUARE";
-                            break;
-                        case FF_TRIANGLE:
-                            waveform = "TRIANGLE";
-                            break;
-                        case FF_SINE:
-                            waveform = "SINE";
-                            break;
-                        case FF_SAW_UP:
-                            waveform = "SAW_UP";
-                            break;
-                        case FF_SAW_DOWN:
-                            waveform = "SAW_DOWN";
-                            break;
-                        case FF_CUSTOM:
-                            waveform = "CUSTOM";
-                            break;
-                    }
-                    snprintf(effect_params, sizeof(effect_params),
-                            "waveform:%s period:%u magnitude:%d offset:%d "
-                            "phase:%u attack_length:%u attack_level:%u "
-                            "fade_length:%u fade_level:%u",
-                            waveform, effect->u.periodic.period,
-                            effect->u.periodic.magnitude,
-                            effect->u.periodic.offset,
-                            effect->u.periodic.phase,
-                            effect->u.periodic.envelope.attack_length,
-                            effect->u.periodic.envelope.attack_level,
-                            effect->u.periodic.envelope.fade_length,
-                            effect->u.periodic.envelope.fade_level);
-                    break;
-                case FF_SPRING:
-                    type = "SPRING";
-                    break;
-                case FF_FRICTION:
-                    type = "FRICTION";
-                    break;
-                case FF_DAMPER:
-                    type = "DAMPER";
-                    break;
-                case FF_INERTIA:
-                    type = "INERTIA";
-                    break;
+            if (upload_fix_count == 0) {
+                report(.op = FFBT_OP_UPLOAD, .dev = device->index, .fd = fd,
+                        .effect = ffbt_effect_pack(effect));
+            } else {
+                ffbt_apply_upload_fixes(device, fd, effect);
             }
 
-            if (effect->type == FF_SPRING || effect->type == FF_FRICTION || effect->type == FF_DAMPER || effect->type == FF_INERTIA) {
-                snprintf(effect_params, sizeof(effect_params),
-                        "right_saturation:%u left_saturation:%u right_coeff:%d "
-                        "left_coeff:%d deadband:%u center:%d",
-                        effect->u.condition[0].right_saturation,
-                        effect->u.condition[0].left_saturation,
-                        effect->u.condition[0].right_coeff,
-                        effect->u.condition[0].left_coeff,
-                        effect->u.condition[0].deadband,
-                        effect->u.condition[0].center);
-            }
-
-            int modified = enable_direction_fix | enable_force_inversion | enable_duration_fix;
-
-            report("%s> UPLOAD id:%d dir:%d length:%d delay:%d type:%s %s",
-                    modified ? "#" : "", effect->id,
-                    effect->direction, effect->replay.length,
-                    effect->replay.delay, type, effect_params);
-
-            if (enable_duration_fix && effect->replay.length == 0) {
-                effect->replay.length = 0xFFFF;
-                report("> UPLOAD id:%d dir:%d type:%s length:%d delay:%d %s "
-                        "# duration fix", effect->id, effect->direction, type,
-                        effect->replay.length, effect->replay.delay,
-                        effect_params);
-            }
-
-            if (enable_direction_fix && (effect->direction == 0 || effect->direction == 0x8000)) {
-                effect->direction = 0x4000;
-                report("> UPLOAD id:%d dir:%d type:%s length:%d delay:%d %s "
-                        "# direction fix", effect->id, effect->direction, type,
-                        effect->replay.length, effect->replay.delay,
-                        effect_params);
-            }
-
-            if (enable_force_inversion) {
-                effect->direction -= 0x8000;
-                report("> UPLOAD id:%d dir:%d type:%s length:%d delay:%d %s "
-                        "# force inversion fix", effect->id, effect->direction,
-                        type, effect->replay.length, effect->replay.delay,
-                        effect_params);
-            }
-
-            if (effect->type == FF_PERIODIC && enable_offset_fix) {
-                effect->u.periodic.offset = (int)effect->u.periodic.offset * 0x7fff / 10000;
-                effect->u.periodic.phase = (int)effect->u.periodic.phase * 0xffff / 35999;
-                snprintf(effect_params, sizeof(effect_params),
-                        "waveform:%s, period:%u, magnitude:%d, offset:%d, phase:%u, attack_length:%u, attack_level:%u, fade_length:%u, fade_level:%u",
-                        waveform, effect->u.periodic.period,
-                        effect->u.periodic.magnitude,
-                        effect->u.periodic.offset,
-                        effect->u.periodic.phase,
-                        effect->u.periodic.envelope.attack_length,
-                        effect->u.periodic.envelope.attack_level,
-                        effect->u.periodic.envelope.fade_length,
-                        effect->u.periodic.envelope.fade_level);
-                report("%s> UPLOAD id:%d dir:%d length:%d delay:%d type:%s %s",
-                        modified ? "#" : "", effect->id,
-                        effect->direction, effect->replay.length,
-                        effect->replay.delay, type, effect_params);
-            }
-
-            if (enable_throttling && effect->id != -1) {
-                if (effect->id > FFBTOOLS_MAX_EFFECT_ID) {
-                    report("# cannot throttle effect, id too large (%d > %d)", effect->id, FFBTOOLS_MAX_EFFECT_ID);
+            if (device->rendering && ffbt_is_condition(effect->type)) {
+                rendered = true;
+            } else if (enable_upload_cache && ffbt_upload_cache_match(device, fd, effect)) {
+                suppressed = true;
+                atomic_fetch_add_explicit(&device->upload_cache_hits, 1, memory_order_relaxed);
+            } else if (device->throttling && effect->id != -1) {
+                if (throttle_leading_edge && ffbt_throttle_pass(device, effect->id, effect->type)) {
+                    // Sent right away
                 } else {
-                    throttled = true;
-                    pthread_spin_lock(&pending_effects_lock);
-                    memcpy((char*) &pending_effects[effect->id], (char*) effect, sizeof(struct ff_effect));
-                    pending_fd[effect->id] = fd;
-                    effect_is_pending[effect->id] = true;
-                    pthread_spin_unlock(&pending_effects_lock);
+                    struct ffbt_throttle_command command = {
+                        .op = FFBT_OP_UPLOAD,
+                        .fd = fd,
+                        .id = effect->id,
+                        .effect = *effect,
+                    };
+
+                    throttled = ffbt_throttle_push(device, &command);
                 }
             }
 
+            // It's cached when it's sent, nothing matches until then
+            if (enable_upload_cache && throttled) {
+                ffbt_upload_cache_remove(device, effect->id);
+            }
+
             break;
     }
 
+    if (throttled) {
+        ffbt_count(device, throttled);
+    } else if (suppressed) {
+        ffbt_count(device, suppressed);
+    } else if (rendered) {
+        ffbt_count(device, rendered);
+    }
+
     int result;
-    if (!throttled) {
-        result = _ioctl(fd, request, argp);
+    if (rendered && effect != NULL) {
+        result = ffbt_render_upload(device, fd, effect);
+        if (result < 0) {
+            errno = -result;
+            result = -1;
+        }
+    } else if (rendered) {
+        result = 0;
+    } else if (!throttled && !suppressed) {
+        result = ffbt_device_ioctl(device, fd, request, argp);
+        if (enable_upload_cache && effect != NULL && result == 0) {
+            ffbt_upload_cache_store(device, fd, effect);
+        }
     } else {
         result = 0;
     }
 
     switch (ioctlRequestCode(request)) {
         case ioctlRequestCode(EVIOCGBIT(EV_FF, 0)):
-            {
-                int passes = 0;
-                do {
-                    strcpy(string, "");
-                    if (testBit(FF_CONSTANT, argp)) strcat(string, " Constant");
-                    if (testBit(FF_PERIODIC, argp)) {
-                        strcat(string, " Periodic (");
-                        if (testBit(FF_SQUARE, argp)) strcat(string, " Square");
-                        if (testBit(FF_TRIANGLE, argp)) strcat(string, " Triangle");
-                        if (testBit(FF_SINE, argp)) strcat(string, " Sine");
-                        if (testBit(FF_SAW_UP, argp)) strcat(string, " Saw up");
-                        if (testBit(FF_SAW_DOWN, argp)) strcat(string, " Saw down");
-                        if (testBit(FF_CUSTOM, argp)) strcat(string, " Custom");
-                        strcat(string, " )");
-                    }
-                    if (testBit(FF_RAMP, argp)) strcat(string, " Ramp");
-                    if (testBit(FF_SPRING, argp)) strcat(string, " Spring");
-                    if (testBit(FF_FRICTION, argp)) strcat(string, " Friction");
-                    if (testBit(FF_DAMPER, argp)) strcat(string, " Damper");
-                    if (testBit(FF_RUMBLE, argp)) strcat(string, " Rumble");
-                    if (testBit(FF_INERTIA, argp)) strcat(string, " Inertia");
-                    if (testBit(FF_GAIN, argp)) strcat(string, " Gain");
-                    if (testBit(FF_AUTOCENTER, argp)) strcat(string, " Autocenter");
-                    if (passes) {
-                        report("< %d, %s # features hack", result, string);
-                        break;
-                    } else {
-                        if (enable_features_hack) {
-                            report("#< %d, %s", result, string);
-                        } else {
-                            report("< %d, %s", result, string);
-                        }
-                    }
-                    if (enable_features_hack) {
-                        memset(argp, 255, _IOC_SIZE(request));
-                        passes++;
-                    }
-                } while (enable_features_hack);
+            if (enable_logger) {
+                struct ffbt_record record = {
+                    .op = FFBT_OP_QUERY,
+                    .flags = FFBT_REC_REPLY | (enable_features_hack || device->rendering ? FFBT_REC_COMMENTED : 0),
+                    .dev = device->index, .fd = fd,
+                    .result = result,
+                };
+                size_t size = _IOC_SIZE(request);
+                memcpy(record.features, argp, size < sizeof(record.features) ? size : sizeof(record.features));
+                ffbt_output(&record);
+            }
+            if (enable_features_hack) {
+                memset(argp, 255, _IOC_SIZE(request));
+                if (enable_logger) {
+                    struct ffbt_record record = {
+                        .op = FFBT_OP_QUERY,
+                        .flags = FFBT_REC_REPLY,
+                        .tag = FFBT_TAG_FEATURES_HACK,
+                        .dev = device->index, .fd = fd,
+                        .result = result,
+                    };
+                    memset(record.features, 255, sizeof(record.features));
+                    ffbt_output(&record);
+                }
+            } else if (device->rendering && result >= 0) {
+                ffbt_render_features((uint8_t*) argp, _IOC_SIZE(request));
+                if (enable_logger) {
+                    struct ffbt_record record = {
+                        .op = FFBT_OP_QUERY,
+                        .flags = FFBT_REC_REPLY,
+                        .tag = FFBT_TAG_RENDERED,
+                        .dev = device->index, .fd = fd,
+                        .result = result,
+                    };
+                    size_t size = _IOC_SIZE(request);
+                    memcpy(record.features, argp, size < sizeof(record.features) ? size : sizeof(record.features));
+                    ffbt_output(&record);
+                }
             }
             break;
         case ioctlRequestCode(EVIOCRMFF):
-            if (enable_features_hack) {
-                report("#< %d", result);
-            } else {
-                report("< %d", result);
+            if (rendered) {
+                report(.op = FFBT_OP_REMOVE, .dev = device->index, .fd = fd, .result = result,
+                        .flags = FFBT_REC_REPLY, .tag = FFBT_TAG_RENDERED);
+                break;
             }
+            report(.op = FFBT_OP_REMOVE, .dev = device->index, .fd = fd, .result = result,
+                    .flags = FFBT_REC_REPLY | (enable_features_hack ? FFBT_REC_COMMENTED : 0));
             if (enable_features_hack && result != 0) {
                 result = 0;
-                report("< %d # features hack", result);
+                report(.op = FFBT_OP_REMOVE, .dev = device->index, .fd = fd, .result = result,
+                        .flags = FFBT_REC_REPLY, .tag = FFBT_TAG_FEATURES_HACK);
             }
             break;
         case ioctlRequestCode(EVIOCGEFFECTS):
-            if (enable_features_hack) {
-                report("#< %d, effects: %d", result, *((int*)argp));
-            } else {
-                report("< %d, effects: %d", result, *((int*)argp));
-            }
+            report(.op = FFBT_OP_SLOTS, .dev = device->index, .fd = fd, .result = result, .value = *((int*)argp),
+                    .flags = FFBT_REC_REPLY | (enable_features_hack ? FFBT_REC_COMMENTED : 0));
             break;
         case ioctlRequestCode(EVIOCSFF):
             effect = (struct ff_effect*) argp;
 
-            if (enable_update_fix && result < 0 && errno == EINVAL && effect->id >= 0) {
-                report("#< %d id:%d", result, effect->id);
+            if (suppressed || rendered) {
+                report(.op = FFBT_OP_UPLOAD, .dev = device->index, .fd = fd, .result = result, .value = effect->id,
+                        .flags = FFBT_REC_REPLY, .tag = suppressed ? FFBT_TAG_SUPPRESSED : FFBT_TAG_RENDERED);
+            } else if (enable_update_fix && result < 0 && errno == EINVAL && effect->id >= 0) {
+                report(.op = FFBT_OP_UPLOAD, .dev = device->index, .fd = fd, .result = result, .value = effect->id,
+                        .flags = FFBT_REC_REPLY | FFBT_REC_COMMENTED);
                 effect->id = -1;
-                result = _ioctl(fd, request, argp);
-                report("< %d id:%d # update fix", result, effect->id);
+                result = ffbt_device_ioctl(device, fd, request, argp);
+                report(.op = FFBT_OP_UPLOAD, .dev = device->index, .fd = fd, .result = result, .value = effect->id,
+                        .flags = FFBT_REC_REPLY, .tag = FFBT_TAG_UPDATE_FIX);
+                if (enable_upload_cache && result == 0) {
+                    ffbt_upload_cache_store(device, fd, effect);
+                }
             } else if (enable_features_hack && result != 0) {
-                report("#< %d id:%d", result, effect->id);
+                report(.op = FFBT_OP_UPLOAD, .dev = device->index, .fd = fd, .result = result, .value = effect->id,
+                        .flags = FFBT_REC_REPLY | FFBT_REC_COMMENTED);
                 if (effect->id == -1) {
-                    effect->id = last_effect_used++;
+                    effect->id = atomic_fetch_add(&device->last_effect_used, 1);
                 }
                 result = 0;
-                report("< %d id:%d # features hack", result, effect->id);
+                report(.op = FFBT_OP_UPLOAD, .dev = device->index, .fd = fd, .result = result, .value = effect->id,
+                        .flags = FFBT_REC_REPLY, .tag = FFBT_TAG_FEATURES_HACK);
             } else {
-                report("< %d id:%d", result, effect->id);
+                report(.op = FFBT_OP_UPLOAD, .dev = device->index, .fd = fd, .result = result, .value = effect->id,
+                        .flags = FFBT_REC_REPLY);
             }
             break;
     }
@@ -547,60 +3031,309 @@ int ioctl(int fd, unsigned long request, char *argp)
 
 ssize_t write(int fd, const void *buf, size_t num)
 {
-    struct input_event *event = NULL;
+    struct ffbt_device *device = ffbt_get_ffb_device(fd);
+    struct input_event *event = (struct input_event*) buf;
     int result;
+    int op;
     bool throttled = false;
+    bool rendered = false;
 
-    event = (struct input_event*) buf;
-
-    if (!ffbt_check_descriptor(fd) || event->type != EV_FF) {
+    if (device == NULL || num < sizeof(*event) || event->type != EV_FF) {
         return _write(fd, buf, num);
     }
 
     switch (event->code) {
         case FF_GAIN:
+            op = FFBT_OP_GAIN;
+            ffbt_count(device, commands[FFBT_CALL_GAIN]);
             if (ignore_set_gain) {
-                report("#> GAIN %d (ignored)", event->value);
+                report(.op = op, .dev = device->index, .fd = fd, .value = event->value,
+                        .flags = FFBT_REC_COMMENTED, .tag = FFBT_TAG_IGNORED);
             } else {
-                report("> GAIN %d", event->value);
+                report(.op = op, .dev = device->index, .fd = fd, .value = event->value);
             }
             break;
         case FF_AUTOCENTER:
-            report("> AUTOCENTER %d", event->value);
+            op = FFBT_OP_AUTOCENTER;
+            ffbt_count(device, commands[FFBT_CALL_AUTOCENTER]);
+            report(.op = op, .dev = device->index, .fd = fd, .value = event->value);
             break;
         default:
-            if (enable_throttling) {
-                if (event->code > FFBTOOLS_MAX_EFFECT_ID) {
-                    report("# cannot throttle effect, id too large (%d > %d)", event->code, FFBTOOLS_MAX_EFFECT_ID);
+            op = FFBT_OP_PLAY;
+            if (event->value > 0) {
+                ffbt_count(device, commands[FFBT_CALL_PLAY]);
+            } else {
+                ffbt_count(device, commands[FFBT_CALL_STOP]);
+            }
+            if (device->rendering && ffbt_render_play(device, fd, event->code, event->value)) {
+                rendered = true;
+            } else if (device->throttling) {
+                if (throttle_leading_edge && ffbt_throttle_pass(device, event->code, 0)) {
+                    // Sent right away
                 } else {
-                    throttled = true;
-                    pthread_spin_lock(&pending_effects_lock);
-                    play_cmd_is_pending[event->code] = true;
-                    pending_play_counts[event->code] = event->value;
-                    pending_fd[event->code] = fd;
-                    pthread_spin_unlock(&pending_effects_lock);
+                    struct ffbt_throttle_command command = {
+                        .op = FFBT_OP_PLAY,
+                        .fd = fd,
+                        .id = event->code,
+                        .value = event->value,
+                    };
+
+                    throttled = ffbt_throttle_push(device, &command);
                 }
             }
-            if (event->value) {
-                report("> PLAY %u %d", event->code, event->value);
-            } else {
-                report("> STOP %u", event->code);
-            }
+            report(.op = op, .dev = device->index, .fd = fd, .value = event->value, .aux = event->code);
             break;
     }
 
-    if ((!ignore_set_gain || event->code != FF_GAIN) && !throttled) {
-        result = _write(fd, buf, num);
+    if (throttled) {
+        ffbt_count(device, throttled);
+    } else if (rendered) {
+        ffbt_count(device, rendered);
+    }
+
+    if ((!ignore_set_gain || event->code != FF_GAIN) && !throttled && !rendered) {
+        result = ffbt_device_write(device, fd, event, num);
     } else {
         result = num;
     }
 
-    report("< %d", result);
+    report(.op = op, .dev = device->index, .fd = fd, .result = result, .flags = FFBT_REC_REPLY,
+            .tag = rendered ? FFBT_TAG_RENDERED : FFBT_TAG_NONE);
 
     if (enable_features_hack && result < 0 && event->code < FF_MAX_EFFECTS) {
         result = num;
-        report("< %d # features hack", result);
+        report(.op = op, .dev = device->index, .fd = fd, .result = result, .flags = FFBT_REC_REPLY,
+                .tag = FFBT_TAG_FEATURES_HACK);
+    }
+
+    return result;
+}
+
+/*
+ * Other libraries' constructors can open files before ours runs.
+ */
+#define ffbt_resolve(function) \
+    do { \
+        if (function == NULL) { \
+            ffbt_resolve_symbols(); \
+        } \
+    } while (0)
+
+#define ffbt_open_mode(flags, mode) \
+    do { \
+        if (__OPEN_NEEDS_MODE(flags)) { \
+            va_list args; \
+            va_start(args, flags); \
+            mode = va_arg(args, mode_t); \
+            va_end(args); \
+        } \
+    } while (0)
+
+int open(const char *pathname, int flags, ...)
+{
+    mode_t mode = 0;
+    int fd;
+
+    ffbt_open_mode(flags, mode);
+    ffbt_resolve(_open);
+
+    fd = _open(pathname, flags, mode);
+    ffbt_track_fd(fd);
+
+    return fd;
+}
+
+int open64(const char *pathname, int flags, ...)
+{
+    mode_t mode = 0;
+    int fd;
+
+    ffbt_open_mode(flags, mode);
+    ffbt_resolve(_open64);
+
+    fd = _open64(pathname, flags, mode);
+    ffbt_track_fd(fd);
+
+    return fd;
+}
+
+int openat(int dirfd, const char *pathname, int flags, ...)
+{
+    mode_t mode = 0;
+    int fd;
+
+    ffbt_open_mode(flags, mode);
+    ffbt_resolve(_openat);
+
+    fd = _openat(dirfd, pathname, flags, mode);
+    ffbt_track_fd(fd);
+
+    return fd;
+}
+
+int openat64(int dirfd, const char *pathname, int flags, ...)
+{
+    mode_t mode = 0;
+    int fd;
+
+    ffbt_open_mode(flags, mode);
+    ffbt_resolve(_openat64);
+
+    fd = _openat64(dirfd, pathname, flags, mode);
+    ffbt_track_fd(fd);
+
+    return fd;
+}
+
+/*
+ * Entry points used instead of the above by programs built with
+ * _FORTIFY_SOURCE.
+ */
+int __open_2(const char *pathname, int flags)
+{
+    int fd;
+
+    ffbt_resolve(__open_2_);
+
+    fd = __open_2_(pathname, flags);
+    ffbt_track_fd(fd);
+
+    return fd;
+}
+
+int __open64_2(const char *pathname, int flags)
+{
+    int fd;
+
+    ffbt_resolve(__open64_2_);
+
+    fd = __open64_2_(pathname, flags);
+    ffbt_track_fd(fd);
+
+    return fd;
+}
+
+int __openat_2(int dirfd, const char *pathname, int flags)
+{
+    int fd;
+
+    ffbt_resolve(__openat_2_);
+
+    fd = __openat_2_(dirfd, pathname, flags);
+    ffbt_track_fd(fd);
+
+    return fd;
+}
+
+int __openat64_2(int dirfd, const char *pathname, int flags)
+{
+    int fd;
+
+    ffbt_resolve(__openat64_2_);
+
+    fd = __openat64_2_(dirfd, pathname, flags);
+    ffbt_track_fd(fd);
+
+    return fd;
+}
+
+int dup(int oldfd)
+{
+    int fd;
+
+    ffbt_resolve(_dup);
+
+    fd = _dup(oldfd);
+    if (fd >= 0) {
+        ffbt_copy_device_fd(oldfd, fd);
+    }
+
+    return fd;
+}
+
+int dup2(int oldfd, int newfd)
+{
+    int fd;
+
+    ffbt_resolve(_dup2);
+
+    // The file replaced is closed
+    if (newfd != oldfd) {
+        ffbt_forget_fd(newfd);
+    }
+
+    fd = _dup2(oldfd, newfd);
+    if (fd >= 0) {
+        ffbt_copy_device_fd(oldfd, fd);
+    }
+
+    return fd;
+}
+
+int dup3(int oldfd, int newfd, int flags)
+{
+    int fd;
+
+    ffbt_resolve(_dup3);
+
+    // The file replaced is closed
+    if (newfd != oldfd) {
+        ffbt_forget_fd(newfd);
+    }
+
+    fd = _dup3(oldfd, newfd, flags);
+    if (fd >= 0) {
+        ffbt_copy_device_fd(oldfd, fd);
+    }
+
+    return fd;
+}
+
+int fcntl(int fd, int cmd, ...)
+{
+    va_list args;
+    void *arg;
+    int result;
+
+    va_start(args, cmd);
+    arg = va_arg(args, void*);
+    va_end(args);
+
+    ffbt_resolve(_fcntl);
+
+    result = _fcntl(fd, cmd, arg);
+    if ((cmd == F_DUPFD || cmd == F_DUPFD_CLOEXEC) && result >= 0) {
+        ffbt_copy_device_fd(fd, result);
     }
 
     return result;
 }
+
+int close(int fd)
+{
+    ffbt_resolve(_close);
+
+    ffbt_forget_fd(fd);
+
+    return _close(fd);
+}
+
+int close_range(unsigned int first, unsigned int last, int flags)
+{
+    ffbt_resolve(_close_range);
+
+    // Descriptors only marked close-on-exec stay open
+    if (!(flags & CLOSE_RANGE_CLOEXEC)) {
+        for (unsigned int fd = first; fd <= last && fd < FFBTOOLS_MAX_TRACKED_FDS; fd++) {
+            if (atomic_load_explicit(&fd_devices[fd], memory_order_relaxed) != 0) {
+                ffbt_forget_fd(fd);
+            }
+        }
+    }
+
+    if (_close_range == NULL) {
+        return syscall(SYS_close_range, first, last, flags);
+    }
+
+    return _close_range(first, last, flags);
+}
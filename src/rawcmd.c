@@ -27,7 +27,12 @@
 #define _GNU_SOURCE
 #include <errno.h>
 #include <fcntl.h>
+#include <getopt.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdatomic.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -39,41 +44,289 @@
 #include <linux/hidraw.h>
 
 #define REPORT_SIZE 8
+#define MAX_REPORT_SIZE 64
+#define MAX_WRITERS 16
+
+/*
+ * Reports are sent in order by the writer threads, each one takes the next
+ * report when it's done with the previous one. With more than one writer
+ * there are several writes in flight.
+ */
+struct burst {
+    int fd;
+    unsigned char *reports;
+    int report_count;
+    size_t report_size;
+    long count;
+    double rate;
+    bool use_poll;
+    uint64_t start_time;
+    atomic_long next;
+    uint32_t *latencies;
+    atomic_long errors;
+    atomic_int last_errno;
+};
+
+static uint64_t get_time()
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+static void sleep_until(uint64_t time)
+{
+    struct timespec deadline = {
+        .tv_sec = time / 1000000000,
+        .tv_nsec = time % 1000000000,
+    };
+
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &deadline, NULL) == EINTR) {
+    }
+}
+
+static void parse_report(unsigned char *report, size_t size, char **bytes, int count)
+{
+    if ((size_t)count > size) {
+        printf("Error: too many arguments.\n");
+        exit(1);
+    }
+
+    for (int i = 0; i < count; i++) {
+        report[i] = strtol(bytes[i], NULL, 0);
+    }
+}
+
+/*
+ * Reads one report per line, as the bytes following the report id separated
+ * by blanks. Empty lines and lines starting with # are skipped.
+ */
+static int read_reports(const char *file_name, unsigned char **reports, size_t size, int report_id)
+{
+    FILE *file = strcmp(file_name, "-") ? fopen(file_name, "r") : stdin;
+    char line[1024];
+    char *bytes[MAX_REPORT_SIZE + 1];
+    char *saveptr;
+    int capacity = 0;
+    int count = 0;
+    int byte_count;
+
+    if (file == NULL) {
+        fprintf(stderr, "ERROR: can not open %s (%s)\n", file_name, strerror(errno));
+        exit(1);
+    }
+
+    *reports = NULL;
+    while (fgets(line, sizeof(line), file) != NULL) {
+        byte_count = 0;
+        bytes[0] = strtok_r(line, " \t\r\n,", &saveptr);
+        if (bytes[0] == NULL || bytes[0][0] == '#') {
+            continue;
+        }
+        while (bytes[byte_count] != NULL && byte_count < MAX_REPORT_SIZE) {
+            bytes[++byte_count] = strtok_r(NULL, " \t\r\n,", &saveptr);
+        }
+
+        if (count == capacity) {
+            capacity = capacity ? capacity * 2 : 256;
+            *reports = realloc(*reports, capacity * size);
+            if (*reports == NULL) {
+                fprintf(stderr, "Error: out of memory.\n");
+                exit(1);
+            }
+        }
+        memset(*reports + count * size, 0, size);
+        (*reports)[count * size] = report_id;
+        parse_report(*reports + count * size + 1, size - 1, bytes, byte_count);
+        count++;
+    }
+
+    if (file != stdin) {
+        fclose(file);
+    }
+
+    return count;
+}
+
+static void *burst_writer(void *arg)
+{
+    struct burst *burst = arg;
+    struct pollfd pollfd = { .fd = burst->fd, .events = POLLOUT };
+    unsigned char *report;
+    uint64_t start;
+    ssize_t res;
+    long i;
+
+    while ((i = atomic_fetch_add(&burst->next, 1)) < burst->count) {
+        report = burst->reports + (i % burst->report_count) * burst->report_size;
+
+        if (burst->rate > 0) {
+            sleep_until(burst->start_time + i * 1e9 / burst->rate);
+        }
+        if (burst->use_poll) {
+            poll(&pollfd, 1, -1);
+        }
+
+        start = get_time();
+        res = write(burst->fd, report, burst->report_size);
+        burst->latencies[i] = get_time() - start;
+
+        if (res < 0) {
+            atomic_fetch_add(&burst->errors, 1);
+            atomic_store(&burst->last_errno, errno);
+        }
+    }
+
+    return NULL;
+}
+
+static int compare_latencies(const void *a, const void *b)
+{
+    uint32_t x = *(const uint32_t*) a;
+    uint32_t y = *(const uint32_t*) b;
+
+    return x < y ? -1 : x > y;
+}
+
+static void print_burst(struct burst *burst, uint64_t elapsed)
+{
+    static const double percentiles[] = {0.5, 0.9, 0.99, 0.999};
+    uint32_t *latencies = burst->latencies;
+    long count = burst->count;
+    double seconds = elapsed / 1e9;
+
+    qsort(latencies, count, sizeof(*latencies), compare_latencies);
+
+    printf("Sent %ld reports of %zu bytes in %.3f s: %.0f reports/s, %.0f bytes/s\n", count,
+            burst->report_size, seconds, count / seconds, count * burst->report_size / seconds);
+    printf("Errors: %ld", atomic_load(&burst->errors));
+    if (atomic_load(&burst->errors) > 0) {
+        printf(" (last: %s)", strerror(atomic_load(&burst->last_errno)));
+    }
+    printf("\n");
+
+    printf("Write latency (us):");
+    for (size_t i = 0; i < sizeof(percentiles) / sizeof(percentiles[0]); i++) {
+        printf(" p%g %.1f", percentiles[i] * 100, latencies[(long)(count * percentiles[i])] / 1e3);
+    }
+    printf(" max %.1f\n", latencies[count - 1] / 1e3);
+}
+
+static void usage(const char *name)
+{
+    printf("Usage: %s <raw device> [--id n] [-s size] <B0> [B1] [B2] [B3] [B4] [B5] [B6] ...\n", name);
+    printf("       %s <raw device> [-s size] [-n count] [-r rate] [-j writers] [-P] [-f file | <B0> [B1] ...]\n", name);
+    printf("Example: %s /dev/hidraw8 0xF3\n", name);
+    printf("Example: %s /dev/hidraw8 -n 10000 -r 500 0x11 0x08 0x80\n", name);
+    exit(1);
+}
 
 int main(int argc, char *argv[])
 {
-    unsigned char report[REPORT_SIZE] = {0};
+    static const struct option long_options[] = {
+        {"id", required_argument, NULL, 'i'},
+        {"size", required_argument, NULL, 's'},
+        {"count", required_argument, NULL, 'n'},
+        {"rate", required_argument, NULL, 'r'},
+        {"writers", required_argument, NULL, 'j'},
+        {"poll", no_argument, NULL, 'P'},
+        {"file", required_argument, NULL, 'f'},
+        {NULL, 0, NULL, 0}
+    };
+    unsigned char *report;
+    char *program_name = argv[0];
     char *device_name;
+    const char *file_name = NULL;
+    struct burst burst;
+    pthread_t writers[MAX_WRITERS];
+    int writer_count = 1;
+    int report_id = 0;
+    bool burst_mode = false;
     static struct timespec t0;
     struct timespec t1;
     unsigned long reltime;
     int res;
+    int c;
 
-    if (argc < 3) {
-        printf("Usage: %s <raw device> [--id n] <B0> [B1] [B2] [B3] [B4] [B5] [B6] ...\n", argv[0]);
-        printf("Example: %s /dev/hidraw8 0xF3\n", argv[0]);
-        exit(1);
-    }
-
-    device_name = argv[1];
+    memset(&burst, 0, sizeof(burst));
+    burst.report_size = REPORT_SIZE;
 
-    argv += 2;
-    argc -= 2;
-
-    if (!strcmp(argv[0], "--id")) {
-        report[0] = strtol(argv[1], NULL, 0);
-        printf("report id: %d\n", report[0]);
-        argv += 2;
-        argc -= 2;
+    while ((c = getopt_long(argc, argv, "s:n:r:j:Pf:", long_options, NULL)) != -1) {
+        switch (c) {
+            case 'i':
+                report_id = strtol(optarg, NULL, 0);
+                printf("report id: %d\n", report_id);
+                break;
+            case 's':
+                burst.report_size = atoi(optarg);
+                if (burst.report_size < 1 || burst.report_size > MAX_REPORT_SIZE) {
+                    printf("Error: report size must be between 1 and %d.\n", MAX_REPORT_SIZE);
+                    exit(1);
+                }
+                break;
+            case 'n':
+                burst.count = atol(optarg);
+                burst_mode = true;
+                break;
+            case 'r':
+                burst.rate = atof(optarg);
+                burst_mode = true;
+                break;
+            case 'j':
+                writer_count = atoi(optarg);
+                if (writer_count < 1 || writer_count > MAX_WRITERS) {
+                    printf("Error: writers must be between 1 and %d.\n", MAX_WRITERS);
+                    exit(1);
+                }
+                burst_mode = true;
+                break;
+            case 'P':
+                burst.use_poll = true;
+                burst_mode = true;
+                break;
+            case 'f':
+                file_name = optarg;
+                burst_mode = true;
+                break;
+            default:
+                usage(program_name);
+        }
     }
 
-    if (argc >= REPORT_SIZE) {
-        printf("Error: too many arguments.");
-        exit(1);
+    if (optind >= argc) {
+        usage(program_name);
     }
 
-    for (int i=0; i < argc; i++) {
-        report[i + 1] = strtol(argv[i], NULL, 0);
+    device_name = argv[optind++];
+    argv += optind;
+    argc -= optind;
+
+    if (file_name != NULL) {
+        if (argc > 0) {
+            printf("Error: reports given both in a file and as arguments.\n");
+            exit(1);
+        }
+        burst.report_count = read_reports(file_name, &burst.reports, burst.report_size, report_id);
+        if (burst.report_count == 0) {
+            printf("Error: no reports in %s.\n", file_name);
+            exit(1);
+        }
+        if (burst.count == 0) {
+            burst.count = burst.report_count;
+        }
+    } else {
+        if (argc < 1) {
+            usage(program_name);
+        }
+        burst.reports = calloc(1, burst.report_size);
+        burst.report_count = 1;
+        burst.reports[0] = report_id;
+        parse_report(burst.reports + 1, burst.report_size - 1, argv, argc);
+        if (burst.count == 0) {
+            burst.count = 1;
+        }
     }
 
     int fd = open(device_name, O_RDWR);
@@ -83,15 +336,45 @@ int main(int argc, char *argv[])
         exit(1);
     }
 
-    clock_gettime(CLOCK_MONOTONIC, &t0);
+    if (!burst_mode) {
+        report = burst.reports;
+
+        clock_gettime(CLOCK_MONOTONIC, &t0);
 
-    res = write(fd, report, REPORT_SIZE);
+        res = write(fd, report, burst.report_size);
 
-    clock_gettime(CLOCK_MONOTONIC, &t1);
-    reltime = (t1.tv_sec - t0.tv_sec) * 1.0e9 + (t1.tv_nsec - t0.tv_nsec);
-    printf("Time: %012lu\n", reltime);
+        clock_gettime(CLOCK_MONOTONIC, &t1);
+        reltime = (t1.tv_sec - t0.tv_sec) * 1.0e9 + (t1.tv_nsec - t0.tv_nsec);
+        printf("Time: %012lu\n", reltime);
+
+        printf("Return value: %d, errno:%d, strerror: %s\n", res, errno, strerror(errno));
+
+        close(fd);
+        return 0;
+    }
+
+    burst.fd = fd;
+    burst.latencies = malloc(burst.count * sizeof(*burst.latencies));
+    if (burst.count < 1 || burst.latencies == NULL) {
+        printf("Error: invalid count.\n");
+        exit(1);
+    }
+
+    burst.start_time = get_time();
+    for (int i = 0; i < writer_count; i++) {
+        res = pthread_create(&writers[i], NULL, burst_writer, &burst);
+        if (res != 0) {
+            fprintf(stderr, "Error creating writer thread: %s\n", strerror(res));
+            exit(1);
+        }
+    }
+    for (int i = 0; i < writer_count; i++) {
+        pthread_join(writers[i], NULL);
+    }
 
-    printf("Return value: %d, errno:%d, strerror: %s\n", res, errno, strerror(errno));
+    print_burst(&burst, get_time() - burst.start_time);
 
+    free(burst.latencies);
+    free(burst.reports);
     close(fd);
 }